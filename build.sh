@@ -94,7 +94,7 @@ printf "${GREEN}------- build libtranscoding --------\n"
 printf "${GREEN}-------------------------------------\n\n${NC}"
 sleep 1
 
-gcc ./src/io_in_memory.c ./src/transcoding.c -std=c99 -shared -fpic -O2 -I$prefix_dir/include -L$prefix_dir/lib -lavutil -lavcodec -lavformat -lswresample -o $prefix_dir/lib/libtranscoding.so
+gcc ./src/io_in_memory.c ./src/audio_header.c ./src/codec_pool.c ./src/output_estimate.c ./src/sample_ring.c ./src/transcoding.c ./src/transcoding_batch.c ./src/transcoding_file.c ./src/transcoder.c -std=c99 -shared -fpic -O2 -I$prefix_dir/include -L$prefix_dir/lib -lavutil -lavcodec -lavformat -lswresample -lpthread -o $prefix_dir/lib/libtranscoding.so
 
 
 rm -rf bin
@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+#
+# Synthesise a corpus of inputs and check the output size estimation on it:
+# fails if the mean absolute error of the estimate exceeds MAX_ERROR percent
+# for any of the output formats.
+#
+# The corpus is encoded by the ffmpeg command line tool (with libmp3lame),
+# which build.sh doesn't build, from 20 s of a sweep with noise so that the
+# VBR encoders vary their bit rate:
+#  - wav, 16-bit stereo and mono
+#  - flac
+#  - mp3 CBR and VBR, each with and without a Xing header, and VBR with a
+#    VBRI header, which no encoder at hand writes: it's put in front of the
+#    frames of the VBR file without Xing
+#  - ADTS, stereo and mono
+#
+# Usage: sh estimate_check.sh [bench binary]
+#
+#   FFMPEG     ffmpeg to encode the corpus with, default ffmpeg
+#   CORPUS     where the corpus is written, default ./corpus
+#   FORMATS    output formats to check, default "mp3 aac opus"
+#   MAX_ERROR  bound of the mean absolute error in percent, default 20
+#
+
+set -e
+
+bench=${1:-./bench}
+ffmpeg=${FFMPEG:-ffmpeg}
+corpus=${CORPUS:-./corpus}
+formats=${FORMATS:-"mp3 aac opus"}
+max_error=${MAX_ERROR:-20}
+
+export LD_LIBRARY_PATH=`pwd`/lib:$LD_LIBRARY_PATH
+
+mkdir -p $corpus
+
+encode() {
+    out=$1
+    shift
+    $ffmpeg -v error -y -i $corpus/source.wav "$@" $out
+}
+
+$ffmpeg -v error -y -f lavfi \
+    -i "aevalsrc=0.4*sin(2*PI*(100+400*t)*t)+0.2*(random(0)-0.5)|0.4*sin(2*PI*330*t)+0.2*(random(1)-0.5):s=44100:d=20" \
+    -c:a pcm_s16le $corpus/source.wav
+
+encode $corpus/mono_22k.wav    -ac 1 -ar 22050 -c:a pcm_s16le
+encode $corpus/stereo.flac     -c:a flac
+encode $corpus/cbr_xing.mp3    -c:a libmp3lame -b:a 128k -id3v2_version 0
+encode $corpus/cbr.mp3         -c:a libmp3lame -b:a 128k -id3v2_version 0 -write_xing 0
+encode $corpus/vbr_xing.mp3    -c:a libmp3lame -q:a 4 -id3v2_version 0
+encode $corpus/vbr.mp3         -c:a libmp3lame -q:a 4 -id3v2_version 0 -write_xing 0
+encode $corpus/stereo.aac      -c:a aac -b:a 128k -f adts
+encode $corpus/mono_48k.aac    -c:a aac -b:a 64k -ac 1 -ar 48000 -f adts
+
+# VBRI header in a frame of its own, 32 bytes after the header of an MPEG-1
+# Layer III frame, as the Fraunhofer encoder writes it.
+python3 - $corpus/vbr.mp3 $corpus/vbr_vbri.mp3 <<'EOF'
+import struct, sys
+
+BIT_RATES = [0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320]
+SAMPLE_RATES = [44100, 48000, 32000]
+
+data = open(sys.argv[1], 'rb').read()
+pos, frames, first = 0, 0, None
+while pos + 4 <= len(data):
+    h = struct.unpack('>I', data[pos:pos + 4])[0]
+    if (h >> 21) != 0x7FF or ((h >> 19) & 3) != 3 or ((h >> 17) & 3) != 1:
+        break
+    size = 144000 * BIT_RATES[(h >> 12) & 15] // SAMPLE_RATES[(h >> 10) & 3] + ((h >> 9) & 1)
+    if first is None:
+        first = (h, size)
+    frames += 1
+    pos += size
+
+if first is None or first[1] < 4 + 32 + 26:
+    sys.exit('no MPEG-1 Layer III frame large enough in ' + sys.argv[1])
+
+h, size = first
+tag = b'VBRI' + struct.pack('>HHHII', 1, 576, 75, size + pos, frames)
+frame = struct.pack('>I', h) + bytes(32) + tag
+frame += bytes(size - len(frame))
+open(sys.argv[2], 'wb').write(frame + data[:pos])
+EOF
+
+inputs="$corpus/source.wav $corpus/mono_22k.wav $corpus/stereo.flac
+        $corpus/cbr_xing.mp3 $corpus/cbr.mp3 $corpus/vbr_xing.mp3 $corpus/vbr.mp3 $corpus/vbr_vbri.mp3
+        $corpus/stereo.aac $corpus/mono_48k.aac"
+
+status=0
+for format in $formats; do
+    echo "== $format"
+    $bench estimate $format --max-error=$max_error $inputs || status=1
+done
+
+exit $status
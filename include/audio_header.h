@@ -0,0 +1,45 @@
+//
+//  audio_header.h
+//
+//  Native parsers of the headers of the most common inputs.
+//
+
+#ifndef transcoding_audio_header_h
+#define transcoding_audio_header_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+
+/**
+ What the header of an input tells about its audio
+ */
+typedef struct AudioHeader {
+    const char    *format_name; /// name of the libavformat demuxer: "mp3", "aac", "wav" or "flac"
+    enum AVCodecID codec_id;
+    int            sample_rate;
+    int            channels;
+    int64_t        duration;    /// in microseconds, 0 if unknown
+    int64_t        bit_rate;    /// 0 if unknown
+} AudioHeader;
+
+
+/**
+ Parse the header of an mp3 (first frame, Xing/LAME or VBRI tag), ADTS
+ (first frames), wav (RIFF fmt and data chunks) or flac (STREAMINFO) input.
+ An ID3v2 tag before the header is skipped.
+
+ @param buf start of the input
+ @param size size in bytes of buf, the header must be in it
+ @param total_size size in bytes of the whole input
+ @param[out] header what the header tells
+
+ @return 0 on success, AVERROR_INVALIDDATA if the input isn't one of these
+ formats or its header isn't in buf
+ */
+int parse_audio_header(const uint8_t *buf, size_t size, size_t total_size, AudioHeader *header);
+
+
+#endif /* transcoding_audio_header_h */
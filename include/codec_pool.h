@@ -0,0 +1,223 @@
+//
+//  codec_pool.h
+//
+//  Process-wide pools of opened codec contexts.
+//
+
+#ifndef transcoding_codec_pool_h
+#define transcoding_codec_pool_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+
+
+/**
+ Encoder parameters decided by set_encoder_params(), used as key of the encoder pool.
+
+ @note: zero the whole struct before filling it, keys are compared bytewise.
+ */
+typedef struct EncoderKey {
+    enum AVCodecID      codec_id;
+    enum AVSampleFormat sample_fmt;
+    int                 sample_rate;
+    int                 channels;
+    uint64_t            channel_layout;
+    int64_t             bit_rate; /// 0 to use the encoder's default
+    int                 flags;    /// AVCodecContext flags, e.g. AV_CODEC_FLAG_GLOBAL_HEADER
+} EncoderKey;
+
+
+/**
+ Max size of extradata a decoder key can hold, decoders whose stream has
+ bigger extradata (e.g. vorbis) are not pooled.
+ */
+#define DECODER_KEY_MAX_EXTRADATA 64
+
+
+/**
+ Demuxed stream parameters a decoder is opened with, used as key of the decoder pool.
+ It's filled by decoder_pool_acquire().
+ */
+typedef struct DecoderKey {
+    enum AVCodecID codec_id;        /// AV_CODEC_ID_NONE if the decoder can't be pooled
+    int            sample_fmt;
+    int            sample_rate;
+    int            channels;
+    uint64_t       channel_layout;
+    int            block_align;
+    int            bits_per_coded_sample;
+    int            extradata_size;
+    uint8_t        extradata[DECODER_KEY_MAX_EXTRADATA];
+} DecoderKey;
+
+
+/**
+ Input and output parameters of a resampler, used as key of the resampler pool.
+
+ @note: zero the whole struct before filling it, keys are compared bytewise.
+ */
+typedef struct ResamplerKey {
+    int                 in_sample_rate;
+    enum AVSampleFormat in_sample_fmt;
+    uint64_t            in_channel_layout;
+    int                 out_sample_rate;
+    enum AVSampleFormat out_sample_fmt;
+    uint64_t            out_channel_layout;
+} ResamplerKey;
+
+
+/**
+ Counters of a codec pool, to tune its limits
+ */
+typedef struct CodecPoolStats {
+    uint64_t hits;      /// checkouts served by an idle context
+    uint64_t misses;    /// checkouts that had to open a new context
+    uint64_t discarded; /// returned contexts freed because the pool was full or they could not be flushed
+    size_t   idle;      /// contexts currently waiting in the pool
+    size_t   in_use;    /// contexts currently checked out
+} CodecPoolStats;
+
+
+/**
+ Make a drained encoder ready to encode a new stream. Only the encoders
+ without delay and the ones with AV_CODEC_CAP_ENCODER_FLUSH can be, e.g.
+ not libmp3lame, libfdk_aac nor libopus: those aren't pooled.
+
+ @return 0 on success, or negative if the encoder keeps state that cannot be
+         flushed, in which case it has to be freed.
+ */
+int flush_encoder(AVCodecContext *encoder);
+
+
+/**
+ Check an opened encoder out of the pool, opening a new one if there is no idle one
+
+ @param key encoder parameters
+ @param codec the encoder matching key->codec_id
+ @param[out] p_encoder pointer to the opened encoder context
+
+ @return 0 on success or negative on error
+ */
+int encoder_pool_acquire(const EncoderKey *key, const AVCodec *codec, AVCodecContext **p_encoder);
+
+
+/**
+ Flush an encoder and give it back to the pool. It's freed instead, and
+ counted as discarded, if the pool is full or the encoder cannot be flushed,
+ see flush_encoder().
+
+ @param key the key the encoder has been acquired with
+ @param[in,out] p_encoder pointer to the encoder context, set to NULL
+ */
+void encoder_pool_release(const EncoderKey *key, AVCodecContext **p_encoder);
+
+
+/**
+ Limit the number of idle encoders kept by the pool.
+ Pass 0 for both to disable pooling.
+
+ @param max_idle_per_key max idle encoders with the same key, default 4
+ @param max_idle_total max idle encoders in all, default 64
+ */
+void encoder_pool_set_limits(size_t max_idle_per_key, size_t max_idle_total);
+
+
+/**
+ Get a snapshot of the encoder pool counters
+
+ @param[out] stats pointer to the counters
+ */
+void encoder_pool_get_stats(CodecPoolStats *stats);
+
+
+/**
+ Free all idle encoders of the pool
+ */
+void encoder_pool_clear(void);
+
+
+
+/**
+ Check an opened decoder for the stream parameters out of the pool,
+ opening a new one if there is no idle one
+
+ @param par parameters of the demuxed stream
+ @param codec the decoder matching par->codec_id
+ @param[out] key filled with the key to release the decoder with
+ @param[out] p_decoder pointer to the opened decoder context
+
+ @return 0 on success or negative on error
+ */
+int decoder_pool_acquire(const AVCodecParameters *par, const AVCodec *codec,
+                         DecoderKey *key, AVCodecContext **p_decoder);
+
+
+/**
+ Flush a decoder and give it back to the pool, it's freed instead if the pool is full.
+
+ @param key the key filled by decoder_pool_acquire()
+ @param[in,out] p_decoder pointer to the decoder context, set to NULL
+ */
+void decoder_pool_release(const DecoderKey *key, AVCodecContext **p_decoder);
+
+
+/**
+ Limit the number of idle decoders kept by the pool, see encoder_pool_set_limits()
+ */
+void decoder_pool_set_limits(size_t max_idle_per_key, size_t max_idle_total);
+
+
+/**
+ Get a snapshot of the decoder pool counters
+ */
+void decoder_pool_get_stats(CodecPoolStats *stats);
+
+
+/**
+ Free all idle decoders of the pool
+ */
+void decoder_pool_clear(void);
+
+
+/**
+ Check an initialized resampler out of the pool, creating a new one if there is no idle one
+
+ @param key resampler parameters
+ @param[out] p_resampler pointer to the initialized resampler
+
+ @return 0 on success or negative on error
+ */
+int resampler_pool_acquire(const ResamplerKey *key, SwrContext **p_resampler);
+
+
+/**
+ Reset a resampler and give it back to the pool, it's freed instead if the pool is full.
+
+ @param key the key the resampler has been acquired with
+ @param[in,out] p_resampler pointer to the resampler, set to NULL
+ */
+void resampler_pool_release(const ResamplerKey *key, SwrContext **p_resampler);
+
+
+/**
+ Limit the number of idle resamplers kept by the pool, see encoder_pool_set_limits()
+ */
+void resampler_pool_set_limits(size_t max_idle_per_key, size_t max_idle_total);
+
+
+/**
+ Get a snapshot of the resampler pool counters
+ */
+void resampler_pool_get_stats(CodecPoolStats *stats);
+
+
+/**
+ Free all idle resamplers of the pool
+ */
+void resampler_pool_clear(void);
+
+
+#endif /* transcoding_codec_pool_h */
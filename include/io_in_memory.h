@@ -24,11 +24,79 @@ typedef struct BufferIO {
     size_t   curr;   /// current position
     size_t   size;   /// real size of used buffer
     size_t   _total; /// private, total size of allocated buffer, _total >= size
+    int      flags;  /// BUFFER_IO_* flags, 0 if buf is allocated by buffer_alloc()
+    size_t   nb_calls; /// read or write callbacks served, for statistics
+    size_t   nb_reallocs; /// times buf was grown or shrunk, for statistics
+    const BufferData *segments; /// read only, segments read in turn instead of buf, NULL if none
+    int      nb_segments;   /// number of segments, their sizes add up to size
+    int      _segment;      /// private, segment of curr
+    size_t   _segment_start; /// private, position of the segment's first byte
 } BufferIO;
 
+/// buf is owned by the caller, it's never reallocated nor freed. When it is
+/// outgrown, the data is moved to a new buffer allocated by buffer_alloc().
+#define BUFFER_IO_BORROWED 0x1
+/// buf can't grow, bytes written past _total are dropped but still counted
+/// in size, so that the required size is known at the end.
+#define BUFFER_IO_FIXED    0x2
+
+/// buf doubles as it's outgrown, up to this size, then grows by this size
+#define BUFFER_IO_GROWTH_CAP (64 * 1024 * 1024)
+
 
 /**
- Make format_context I/O in memory
+ *  Output written in memory to a chain of fixed size chunks, never copied
+ *  to grow. Every chunk but the last one is full.
+ */
+typedef struct ChunkedIO {
+    BufferData *chunks;     /// chunks of BUFFER_CHUNK_SIZE bytes, size is their used part
+    int         nb_chunks;  /// number of chunks
+    size_t      curr;       /// current position
+    size_t      size;       /// real size of the written data
+    size_t      nb_calls;   /// write callbacks served, for statistics
+    int         _allocated; /// private, number of slots in chunks
+} ChunkedIO;
+
+/// size of a chunk of ChunkedIO
+#define BUFFER_CHUNK_SIZE (256 * 1024)
+
+
+/**
+ Allocator of the library-owned buffers: the in-memory output, the BufferIO
+ structs and the scratch sample buffers. Frames, packets and codec contexts
+ are still allocated by FFmpeg.
+
+ The default allocator uses av_malloc(), and mmap() for large buffers so that
+ they are grown by mremap() without copying where it's available.
+
+ @alloc: allocate size bytes, NULL on failure
+ @realloc: resize ptr to size bytes, ptr is never NULL
+ @free: free ptr, ptr is never NULL
+ @opaque: passed to every callback
+ */
+typedef struct TranscodingAllocator {
+    void *(*alloc)(void *opaque, size_t size);
+    void *(*realloc)(void *opaque, void *ptr, size_t size);
+    void  (*free)(void *opaque, void *ptr);
+    void  *opaque;
+} TranscodingAllocator;
+
+
+/**
+ Set the allocator of the buffers, NULL to restore the default one.
+
+ @warning: not thread safe, set it before any buffer is allocated. Buffers
+  have to be freed by the allocator that allocated them.
+ */
+void buffer_set_allocator(const TranscodingAllocator *allocator);
+
+void *buffer_alloc(size_t size);
+void *buffer_realloc(void *ptr, size_t size); /// ptr may be NULL
+void  buffer_free(void *ptr);                 /// ptr may be NULL
+
+
+/**
+ Make format_context I/O in memory, with an AVIO buffer of 4 KB
  
  @param write_flag Set to 1 if the buffer should be writable, 0 otherwise.
         Typically 0 for input format context and 1 for output format context.
@@ -39,6 +107,28 @@ typedef struct BufferIO {
 int init_io_context_default(AVFormatContext *format_context, int write_flag, BufferIO *bio);
 
 
+/**
+ Make format_context I/O in memory, see init_io_context_default()
+
+ @param buffer_size Size of the AVIO buffer, see init_io_context_custom().
+ */
+int init_io_context_sized(AVFormatContext *format_context, int buffer_size, int write_flag, BufferIO *bio);
+
+
+/**
+ Make format_context read from memory without a bounce buffer
+
+ Reads are copied from bio straight to the demuxer's destination, such as a
+ packet, instead of through the AVIO buffer. The buffer of buffer_size bytes
+ is only a window for the demuxer's small header reads.
+
+ @param bio An pointer to BufferIO data, read only.
+
+ @return 0 on success or negative on error.
+ */
+int init_io_context_direct(AVFormatContext *format_context, int buffer_size, BufferIO *bio);
+
+
 /**
  Make format_context I/O in memory
 
@@ -65,5 +155,49 @@ int init_io_context_custom(AVFormatContext *format_context,
                            int64_t (*seek)(void *opaque, int64_t offset, int whence));
 
 
+
+/**
+ Make format_context write to memory, in a chain of chunks
+
+ @param buffer_size Size of the AVIO buffer, see init_io_context_custom().
+ @param cio An pointer to ChunkedIO data, zeroed.
+
+ @return 0 on success or negative on error.
+ */
+int init_io_context_chunked(AVFormatContext *format_context, int buffer_size, ChunkedIO *cio);
+
+
+/**
+ Release one chunk of a ChunkedIO to the process-wide pool of chunks, or
+ free it if the pool is full.
+
+ @param[in,out] chunk chunk of a ChunkedIO, reset to empty
+ */
+void release_chunk(BufferData *chunk);
+
+
+/**
+ Release the chunks left in an array of chunks, and free the array.
+
+ @param[in,out] p_chunks pointer to the array, set to NULL
+ */
+void release_chunks(BufferData **p_chunks, int nb_chunks);
+
+
+/**
+ Shrink bio's buffer to its size, unless it's the caller's.
+
+ @return 0 on success or negative on error, the buffer is then kept as is.
+ */
+int shrink_buffer_io(BufferIO *bio);
+
+
+/**
+ Free an I/O context made by init_io_context_default() or
+ init_io_context_custom(), and its buffer. The opaque is left to the caller.
+ */
+void free_io_context(AVIOContext **pb);
+
+
 #endif /* transcoding_io_in_memory_h */
 
@@ -0,0 +1,46 @@
+//
+//  output_estimate.h
+//
+//  Estimation of the output size, to allocate the output buffer once.
+//
+
+#ifndef transcoding_output_estimate_h
+#define transcoding_output_estimate_h
+
+#include <stddef.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+
+/**
+ Duration in seconds of the input's audio stream
+
+ Taken from the stream, then from the container, which includes the VBR
+ headers (Xing/VBRI) read by the demuxer and the headers parsed natively
+ (see audio_header.h), else from the input size and its bit rate. AV_NOPTS_VALUE durations are skipped.
+
+ @param src_size size in bytes of the whole input
+
+ @return the duration, or 0 if unknown
+ */
+double estimate_input_duration(const AVFormatContext *input_format_context, size_t src_size);
+
+
+/**
+ Estimate the output size in bytes: the encoded audio at the encoder's bit
+ rate, or the PCM rate for lossless codecs, plus the container's header and
+ per frame overhead, and a safety margin.
+
+ @param input_format_context the opened input
+ @param src_size size in bytes of the whole input
+ @param output_format the output container
+ @param encoder the opened encoder
+
+ @return the estimated size, never 0
+ */
+size_t estimate_output_size(const AVFormatContext *input_format_context, size_t src_size,
+                            const AVOutputFormat *output_format, const AVCodecContext *encoder);
+
+
+#endif /* transcoding_output_estimate_h */
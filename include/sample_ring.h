@@ -0,0 +1,87 @@
+//
+//  sample_ring.h
+//
+//  FIFO of audio samples laid out as encoder frames, read without a copy.
+//
+
+#ifndef transcoding_sample_ring_h
+#define transcoding_sample_ring_h
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+
+/**
+ Ring of samples in one sample format, made of slots of one encoder frame.
+ The samples are written in place, e.g. by the resampler, and read as frames
+ pointing into the ring, so that they are neither copied into nor out of it.
+ Samples written past the end of the ring land in an overflow area of the
+ same size and are moved to its start, so a slot never wraps around.
+
+ The frames reference their slot, which isn't written again until the last
+ reference is gone. The references may be dropped on any thread, e.g. by the
+ encoder, but in the order the frames are read. Otherwise the ring isn't
+ thread-safe.
+ */
+typedef struct SampleRing SampleRing;
+
+
+/**
+ Allocate a ring
+
+ @param frame_size samples of a slot, i.e. of an encoder frame
+ @param nb_samples samples the ring holds at first, rounded up to a whole slot
+
+ @return 0 on success, a negative AVERROR on failure
+ */
+int sample_ring_alloc(SampleRing **ring, enum AVSampleFormat sample_fmt, int channels,
+                      int frame_size, int nb_samples);
+
+/// Free a ring, *ring is set to NULL. It's freed once no frame read from it is referenced.
+void sample_ring_free(SampleRing **ring);
+
+/// Drop all the samples, the frame read from the ring must have been released.
+void sample_ring_reset(SampleRing *ring);
+
+/// Samples stored and not read yet
+int sample_ring_size(const SampleRing *ring);
+
+/// Whether nb_samples can be reserved now, i.e. fit or the ring can grow.
+int sample_ring_can_write(SampleRing *ring, int nb_samples);
+
+
+/**
+ Make room for nb_samples after the stored samples, growing the ring if
+ needed, and return where to write them. They're added by sample_ring_commit().
+
+ @param[out] data one pointer per plane, valid until the commit
+
+ @return 0 on success, AVERROR(EAGAIN) if the ring has to grow while frames
+ read from it are referenced, another negative AVERROR on failure
+ */
+int sample_ring_reserve(SampleRing *ring, int nb_samples, uint8_t ***data);
+
+/// Add nb_samples written where sample_ring_reserve() told, at most the ones reserved.
+void sample_ring_commit(SampleRing *ring, int nb_samples);
+
+/// Copy nb_samples into the ring, see sample_ring_reserve() for the errors.
+int sample_ring_write(SampleRing *ring, uint8_t * const *data, int nb_samples);
+
+
+/**
+ Take the next nb_samples of the ring into frame, which references them where
+ they are: av_frame_ref() of it doesn't copy them. The caller reads one frame
+ at a time and sets the other fields of the frame.
+
+ @return 0 on success, AVERROR(EINVAL) if fewer samples are stored or the
+ caller's frame isn't released, another negative AVERROR on failure
+ */
+int sample_ring_read_frame(SampleRing *ring, AVFrame *frame, int nb_samples);
+
+/// Unreference the caller's frame read from the ring, the next one can be read.
+void sample_ring_release_frame(SampleRing *ring, AVFrame *frame);
+
+
+#endif /* transcoding_sample_ring_h */
@@ -20,6 +20,22 @@
  @bit_rate: controls the compression rate of target audio, pass 0 to use default value
  @format_name: target media container name,
   see all supported formats name by executing `ffmpeg -formats`
+ @in_buffer_size: bytes the input is read by, pass 0 to size it after the input
+ @out_buffer_size: bytes the output is written by, pass 0 to size it after
+  the expected output, or to the sink's flush threshold
+ @shrink_output: pass 1 to shrink the output buffer to its size at the end,
+  e.g. when it's cached, 0 to keep the slack of its growth
+ @in_format_name: container of the input if it's known, e.g. from the file
+  extension or the Content-Type, such as "mp3" or "wav". Pass NULL to probe it.
+ @probesize: max bytes read to probe the input, pass 0 to use default value
+ @analyze_duration: max microseconds of input decoded to find the stream
+  parameters, pass 0 to use default value. The stream parameters aren't
+  searched at all when the input's header has them, except for AAC.
+
+ An input already in the target format's codec, at sample_rate if it's set
+ and at most at bit_rate if it's set, isn't transcoded: its packets are
+ copied into the target container, or its bytes are if the container is the
+ same too, e.g. an mp3 to "mp3" or an m4a to "aac".
 
  @note: every argument have to be explicitly assigned.
 
@@ -29,13 +45,94 @@ typedef struct TranscodingArgs {
     int     sample_rate;
     int64_t bit_rate;
     char   *format_name;
+    int     in_buffer_size;
+    int     out_buffer_size;
+    int     shrink_output;
+    char   *in_format_name;
+    int64_t probesize;
+    int64_t analyze_duration;
 } TranscodingArgs;
 
 
+/**
+ Statistics of a transcoding job
+
+ @output_estimate: bytes estimated for the output before transcoding, 0 if
+  the output isn't allocated by the library
+ @nb_reallocs: times the output buffer was grown or shrunk
+ @output_capacity: bytes allocated for the output at the end, 0 if streamed
+ @nb_read_calls: read callbacks on the in-memory input
+ @nb_write_calls: write callbacks on the in-memory output
+ */
+typedef struct TranscodingStats {
+    size_t output_estimate;
+    size_t nb_reallocs;
+    size_t output_capacity;
+    size_t nb_read_calls;
+    size_t nb_write_calls;
+} TranscodingStats;
+
+
+/**
+ Initialize the library once: register codecs and muxers and resolve the
+ codecs of the common formats. Call it at startup before starting any
+ thread that transcodes.
+
+ It's safe to call it several times and from several threads, every entry
+ point also calls it lazily.
+
+ @return 0 on success or negative on error
+ */
+int transcoding_global_init(void);
+
+
+/**
+ Set the allocator of the buffers owned by the library, such as the output
+ audio buffers, NULL to restore the default one, see TranscodingAllocator.
+
+ @warning: not thread safe, set it at startup before anything is transcoded.
+
+ @param allocator alloc, realloc and free callbacks, copied
+ */
+void transcoding_set_allocator(const TranscodingAllocator *allocator);
+
+
+/**
+ Free an output audio buffer returned by the library, with the allocator
+ that allocated it.
+
+ @param[in,out] buf output audio buffer, reset to empty
+ */
+void transcoding_free_output(BufferData *buf);
+
+
+/**
+ Release one chunk of a chunked output, so that the chunks can be released
+ as soon as they are consumed, e.g. uploaded.
+
+ @param[in,out] chunk chunk returned by transcoding_chunked(), reset to empty
+ */
+void transcoding_free_chunk(BufferData *chunk);
+
+
+/**
+ Release the chunks of a chunked output that are left, and the array.
+
+ @param[in,out] p_chunks pointer to the array returned by transcoding_chunked(), set to NULL
+ @param nb_chunks number of chunks in the array
+ */
+void transcoding_free_chunks(BufferData **p_chunks, int nb_chunks);
+
+
 /**
  transcoding audio format in memory
 
- @param[in,out] p_dst_buf pointer to output audio buffer
+ @note API change: the output buffer used to be allocated by av_malloc(), it's
+  now allocated by the library's allocator. The default one puts a header
+  before the buffer and maps the large ones, so it must be freed with
+  transcoding_free_output(), never with free() or av_free().
+
+ @param[in,out] p_dst_buf pointer to output audio buffer, free it with transcoding_free_output()
  @param[in,out] out_bit_rate bit rate of output audio
  @param[in,out] out_duration duration in seconds of output audio
  @param args target audio format args
@@ -46,4 +143,415 @@ typedef struct TranscodingArgs {
 int transcoding(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration, const TranscodingArgs args, const BufferData src_buf);
 
 
+/**
+ transcoding audio format in memory, from an input in several segments
+
+ The segments are read in turn as one input, without concatenating them,
+ e.g. as they were received from the network.
+
+ @param[in,out] p_dst_buf pointer to output audio buffer, free it with transcoding_free_output()
+ @param[in,out] out_bit_rate bit rate of output audio
+ @param[in,out] out_duration duration in seconds of output audio
+ @param args target audio format args
+ @param src_segments array of source audio segments, in order
+ @param nb_segments number of segments
+
+ @return 0 on success or negative on error
+ */
+int transcoding_segments(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                         const TranscodingArgs args, const BufferData *src_segments, int nb_segments);
+
+
+/**
+ transcoding audio format in memory, into an output region provided by the caller
+
+ Nothing is allocated for the output as long as it fits in the region. When
+ it doesn't:
+ - without spill, AVERROR(ENOSPC) is returned and p_dst_buf->size is set to
+   the required size. Pass an empty region to query the size.
+ - with spill, the output is moved to a buffer allocated by the library,
+   p_dst_buf->buf then differs from the region and must be freed by transcoding_free_output().
+   The region is left to the caller.
+
+ @param[in,out] p_dst_buf output region in, output audio buffer out
+ @param[in,out] out_bit_rate bit rate of output audio
+ @param[in,out] out_duration duration in seconds of output audio
+ @param args target audio format args
+ @param src_buf source audio buffer
+ @param spill 1 to grow past the region, 0 to fail
+
+ @return 0 on success, AVERROR(ENOSPC) if the region is too small, or negative on error
+ */
+int transcoding_into(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                     const TranscodingArgs args, const BufferData src_buf, int spill);
+
+
+/**
+ transcoding audio format in memory, into a chain of chunks
+
+ The output is written to chunks of 256 KB, which are never copied to grow,
+ and returned as an array, e.g. for writev() or a multipart upload. Every
+ chunk but the last one is full. The chunks come from a process-wide pool.
+
+ @param[out] p_chunks array of output chunks, free it with transcoding_free_chunks()
+ @param[out] nb_chunks number of output chunks
+ @param[in,out] out_bit_rate bit rate of output audio
+ @param[in,out] out_duration duration in seconds of output audio
+ @param args target audio format args
+ @param src_buf source audio buffer
+
+ @return 0 on success or negative on error
+ */
+int transcoding_chunked(BufferData **p_chunks, int *nb_chunks, int *out_bit_rate, float *out_duration,
+                        const TranscodingArgs args, const BufferData src_buf);
+
+
+/**
+ transcoding audio format from file to file
+
+ The input is mapped rather than read in memory, so it may be larger than
+ 2 GB, and the output is written to the file as it's muxed. The output file
+ is removed on error.
+
+ @param in_path path of the source audio file
+ @param out_path path of the output audio file, created or truncated
+ @param[in,out] out_bit_rate bit rate of output audio
+ @param[in,out] out_duration duration in seconds of output audio
+ @param args target audio format args
+
+ @return 0 on success or negative on error
+ */
+int transcoding_file(const char *in_path, const char *out_path,
+                     int *out_bit_rate, float *out_duration, const TranscodingArgs args);
+
+
+/**
+ Sink the output is streamed to, as soon as the muxer produces it
+
+ @write: called with every flush_threshold bytes of output, and with the
+  rest at the end. Return 0 on success, or negative to abort the transcoding.
+ @opaque: passed to write
+ @flush_threshold: max bytes of output held in memory before they are
+  written, pass 0 to use the args' out_buffer_size, or else 4 KB
+ */
+typedef struct TranscodingSink {
+    int   (*write)(void *opaque, const uint8_t *buf, size_t size);
+    void   *opaque;
+    size_t  flush_threshold;
+} TranscodingSink;
+
+
+/**
+ transcoding audio format from memory to a sink
+
+ @warning: the output can't be seeked back, so only streaming formats,
+  such as mp3, aac (adts), ogg and opus, are supported. The formats whose
+  muxer seeks back, m4a/mp4/mov/ipod, wav and flac, are rejected.
+
+ @param sink sink of the output audio
+ @param[in,out] out_bit_rate bit rate of output audio
+ @param[in,out] out_duration duration in seconds of output audio
+ @param args target audio format args
+ @param src_buf source audio buffer
+
+ @return 0 on success, AVERROR(EINVAL) for a format that needs a seekable
+ output, or negative on another error
+ */
+int transcoding_to_sink(const TranscodingSink *sink, int *out_bit_rate, float *out_duration,
+                        const TranscodingArgs args, const BufferData src_buf);
+
+
+/**
+ Options of transcoding_multi()
+
+ @parallel_encoders: set to 1 to run every output's encoder on its own thread,
+  while the source is decoded on the calling thread
+ */
+typedef struct TranscodingMultiOptions {
+    int parallel_encoders;
+} TranscodingMultiOptions;
+
+
+/**
+ transcoding audio in memory to several target formats in a single pass
+
+ The source is decoded once. Outputs whose encoders take the same sample
+ rate, sample format and channel layout share one resampler.
+
+ @param[in,out] dst_bufs array of nb_outputs output audio buffers, free each with transcoding_free_output()
+ @param[in,out] out_bit_rates array of nb_outputs bit rates of output audio, may be NULL
+ @param[in,out] out_durations array of nb_outputs durations in seconds of output audio, may be NULL
+ @param args array of nb_outputs target audio format args
+ @param nb_outputs number of outputs
+ @param src_buf source audio buffer
+ @param opts options, may be NULL
+
+ @return 0 on success or negative on error
+ */
+int transcoding_multi(BufferData *dst_bufs, int *out_bit_rates, float *out_durations,
+                      const TranscodingArgs *args, int nb_outputs,
+                      const BufferData src_buf, const TranscodingMultiOptions *opts);
+
+
+/**
+ Reusable transcoding session for one target audio format.
+
+ The session keeps its encoder, resampler and FIFO between calls of
+ transcoding_session_transcode(), and only flushes them between inputs.
+ They are rebuilt when an input's sample rate, sample format or channel
+ count differs from the previous one. Encoders that can't be flushed, such
+ as the mp3 (libmp3lame), aac (libfdk_aac) and opus (libopus) ones, are
+ opened again for every input.
+
+ @note: a session must not be used by several threads at the same time.
+ */
+typedef struct TranscodingSession TranscodingSession;
+
+
+/**
+ Create a transcoding session
+
+ @param[out] p_session pointer to the created session
+ @param args target audio format args, format_name is copied
+
+ @return 0 on success or negative on error
+ */
+int transcoding_session_create(TranscodingSession **p_session, const TranscodingArgs args);
+
+
+/**
+ transcoding audio format in memory, reusing the session's contexts
+
+ @param session session created by transcoding_session_create()
+ @param[in,out] p_dst_buf pointer to output audio buffer, free it with transcoding_free_output()
+ @param[in,out] out_bit_rate bit rate of output audio
+ @param[in,out] out_duration duration in seconds of output audio
+ @param src_buf source audio buffer
+
+ @return 0 on success or negative on error
+ */
+int transcoding_session_transcode(TranscodingSession *session,
+                                  BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                                  const BufferData src_buf);
+
+
+/**
+ transcoding audio format from an input in segments, reusing the session's contexts
+
+ @see transcoding_segments()
+
+ @return 0 on success or negative on error
+ */
+int transcoding_session_transcode_segments(TranscodingSession *session,
+                                           BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                                           const BufferData *src_segments, int nb_segments);
+
+
+/**
+ transcoding audio format into a caller's output region, reusing the session's contexts
+
+ @see transcoding_into()
+
+ @return 0 on success, AVERROR(ENOSPC) if the region is too small, or negative on error
+ */
+int transcoding_session_transcode_into(TranscodingSession *session,
+                                       BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                                       const BufferData src_buf, int spill);
+
+
+/**
+ transcoding audio format into a chain of chunks, reusing the session's contexts
+
+ @see transcoding_chunked()
+
+ @return 0 on success or negative on error
+ */
+int transcoding_session_transcode_chunked(TranscodingSession *session,
+                                          BufferData **p_chunks, int *nb_chunks,
+                                          int *out_bit_rate, float *out_duration,
+                                          const BufferData src_buf);
+
+
+/**
+ transcoding audio format from memory to a sink, reusing the session's contexts
+
+ @see transcoding_to_sink()
+
+ @return 0 on success, AVERROR(EINVAL) if the session's format needs a
+ seekable output, or negative on another error
+ */
+int transcoding_session_transcode_to_sink(TranscodingSession *session,
+                                          const TranscodingSink *sink,
+                                          int *out_bit_rate, float *out_duration,
+                                          const BufferData src_buf);
+
+
+/**
+ transcoding audio format from file to file, reusing the session's contexts
+
+ @see transcoding_file()
+
+ @return 0 on success or negative on error
+ */
+int transcoding_session_transcode_file(TranscodingSession *session,
+                                       const char *in_path, const char *out_path,
+                                       int *out_bit_rate, float *out_duration);
+
+
+/**
+ Flush the session's encoder, resampler and FIFO so that no state of the
+ previous input is left. transcoding_session_transcode() does this by itself,
+ so it's only needed to drop a failed job's state early.
+
+ @param session session created by transcoding_session_create()
+ */
+void transcoding_session_reset(TranscodingSession *session);
+
+
+/**
+ Get the statistics of the session's last successful job
+
+ @param session session created by transcoding_session_create()
+ @param[out] stats statistics of the job, zeroed if none
+ */
+void transcoding_session_get_stats(const TranscodingSession *session, TranscodingStats *stats);
+
+
+/**
+ Free the session and all of its contexts
+
+ @param[in,out] p_session pointer to the session, set to NULL
+ */
+void transcoding_session_destroy(TranscodingSession **p_session);
+
+
+
+/**
+ Incremental transcoder, for input that arrives in chunks.
+
+ The input is decoded and encoded on a thread of the transcoder while it's
+ fed, and the output can be drained as soon as it's written. The whole
+ input is kept until the transcoder is destroyed, so that the demuxer can
+ seek back; seeks forward wait until the input is fed.
+
+ @warning: the output can't be seeked back, so only streaming formats,
+  such as mp3, aac (adts), ogg and opus, are supported. The formats whose
+  muxer seeks back, m4a/mp4/mov/ipod, wav and flac, are rejected by
+  transcoder_create().
+ */
+typedef struct Transcoder Transcoder;
+
+
+/**
+ Create an incremental transcoder
+
+ @param[out] p_transcoder pointer to the created transcoder
+ @param args target audio format args, format_name is copied
+
+ @return 0 on success, AVERROR(EINVAL) for a format that needs a seekable
+ output, or negative on another error
+ */
+int transcoder_create(Transcoder **p_transcoder, const TranscodingArgs args);
+
+
+/**
+ Feed the next chunk of input, the chunk is copied
+
+ @return 0 on success or negative on error, e.g. if the job already failed
+ */
+int transcoder_feed(Transcoder *transcoder, const BufferData chunk);
+
+
+/**
+ Take the output written since the last drain, without waiting
+
+ @param[out] out output audio written since the last drain, empty if none.
+             Free it with transcoding_free_output().
+
+ @return 0 on success or negative if the job failed
+ */
+int transcoder_drain(Transcoder *transcoder, BufferData *out);
+
+
+/**
+ Mark the end of the input, wait for the job to end and take the rest of the output
+
+ @param[out] out output audio written since the last drain, free it with transcoding_free_output()
+ @param[out] out_bit_rate bit rate of the whole output audio
+ @param[out] out_duration duration in seconds of the whole output audio
+
+ @return 0 on success or negative on error
+ */
+int transcoder_finish(Transcoder *transcoder, BufferData *out, int *out_bit_rate, float *out_duration);
+
+
+/**
+ Free the transcoder, aborting its job if it's not finished
+
+ @param[in,out] p_transcoder pointer to the transcoder, set to NULL
+ */
+void transcoder_destroy(Transcoder **p_transcoder);
+
+
+/**
+ One job of a batch
+
+ @note: args and src_buf have to be assigned, the rest is set by transcoding_batch().
+ */
+typedef struct TranscodingJob {
+    TranscodingArgs args;         /// target audio format args
+    BufferData      src_buf;      /// source audio buffer
+    BufferData      dst_buf;      /// output audio buffer, free it with transcoding_free_output()
+    int             out_bit_rate; /// bit rate of output audio
+    float           out_duration; /// duration in seconds of output audio
+    int             status;       /// 0 on success or negative on error
+    TranscodingStats stats;       /// statistics of the job
+} TranscodingJob;
+
+
+/**
+ Batch options
+
+ @max_workers: max number of workers running jobs of the batch at the same time,
+  pass 0 to use all of them
+ */
+typedef struct TranscodingBatchOptions {
+    int max_workers;
+} TranscodingBatchOptions;
+
+
+/**
+ Start the worker pool used by transcoding_batch(). It's started by the
+ first batch otherwise, with one worker per online core.
+
+ Each worker keeps warm sessions for the args it has most recently seen.
+
+ @param nb_workers number of workers, pass 0 for one worker per online core
+
+ @return 0 on success or negative on error
+ */
+int transcoding_batch_start(int nb_workers);
+
+
+/**
+ Stop the worker pool and free the sessions of its workers.
+
+ @warning: no batch may be running or started while stopping.
+ */
+void transcoding_batch_stop(void);
+
+
+/**
+ transcoding jobs in parallel on the worker pool, and wait for all of them
+
+ @param[in,out] jobs jobs to run, their results are stored in place
+ @param nb_jobs number of jobs
+ @param opts batch options, may be NULL
+
+ @return 0 if every job succeeded, or negative on error: the status of the
+         first failed job, or the error starting the pool
+ */
+int transcoding_batch(TranscodingJob *jobs, size_t nb_jobs, const TranscodingBatchOptions *opts);
+
+
 #endif /* transcoding_h */
@@ -0,0 +1,96 @@
+//
+//  transcoding_internal.h
+//
+//  Internals shared by the transcoding entry points, not part of the public API.
+//
+
+#ifndef transcoding_transcoding_internal_h
+#define transcoding_transcoding_internal_h
+
+#include <stdint.h>
+
+#include "io_in_memory.h"
+#include "transcoding.h"
+
+
+/**
+ Where a job reads its input and writes its output
+
+ The input is read from src_buf unless read_packet is set, and the output
+ is written to a new in-memory buffer unless write_packet is set.
+ The callbacks follow the conventions of avio_alloc_context(), a NULL seek
+ makes the stream non-seekable.
+ */
+typedef struct JobIO {
+    BufferData src_buf;
+    const BufferData *src_segments; /// read in turn instead of src_buf.buf if set, src_buf.size is their total size
+    int        nb_src_segments;
+    int        read_copy;  /// read src_buf through the AVIO buffer instead of directly, for benchmarks
+    int        find_stream_info; /// search the stream parameters even if the header has them, for benchmarks
+    int        probe_format; /// let libavformat probe the format instead of parsing the header natively, for benchmarks
+    int        transcode_always; /// decode and encode even if the input could be copied, for benchmarks
+    void      *read_opaque;
+    int      (*read_packet)(void *opaque, uint8_t *buf, int buf_size);
+    int64_t  (*read_seek)(void *opaque, int64_t offset, int whence);
+
+    void      *write_opaque;
+    int      (*write_packet)(void *opaque, uint8_t *buf, int buf_size);
+    int64_t  (*write_seek)(void *opaque, int64_t offset, int whence);
+    int        write_buffer_size; /// bytes written to write_packet at once, 0 for the args' one
+    const BufferData *dst_region; /// caller's output region, used unless write_packet is set
+    ChunkedIO *dst_chunks; /// chunked output, used unless write_packet or dst_region is set
+    int        dst_spill;  /// move the output to a buffer_alloc() buffer when dst_region is outgrown, freed by transcoding_free_output()
+} JobIO;
+
+
+/**
+ What a job produced
+ */
+typedef struct JobResult {
+    BufferIO *bio;         /// in-memory output, NULL if written by write_packet or to dst_chunks
+    int64_t   nb_samples;  /// number of samples encoded
+    int       sample_rate; /// sample rate of the encoder
+    TranscodingStats stats;
+} JobResult;
+
+
+/**
+ Args the session was created with
+ */
+const TranscodingArgs *transcoding_session_args(const TranscodingSession *session);
+
+
+/**
+ Run one job with the session's contexts
+
+ @param session session created by transcoding_session_create()
+ @param io input and output of the job
+ @param[out] result what the job produced, its in-memory output is owned by the caller
+
+ @return 0 on success or negative on error
+ */
+int transcoding_session_run(TranscodingSession *session, const JobIO *io, JobResult *result);
+
+
+/**
+ Compute the bit rate and duration of an output
+
+ @param size size in bytes of the output
+ @param result result of the job
+ @param[out] out_bit_rate bit rate of output audio, rounded down to kbps, 0 if the duration is unknown
+ @param[out] out_duration duration in seconds of output audio, 0 if unknown
+ */
+void get_job_output_info(size_t size, const JobResult *result, int *out_bit_rate, float *out_duration);
+
+
+/**
+ Whether the muxer of a format seeks back to finish the file, e.g. to write
+ the moov atom of mp4 or the sizes in the header of wav, so that it can't
+ write to a sink or a transcoder, whose output is drained as it's written.
+
+ @param format_name format name as in TranscodingArgs, such as "m4a"
+ */
+int needs_seekable_output(const char *format_name);
+
+
+#endif /* transcoding_transcoding_internal_h */
@@ -0,0 +1,370 @@
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/error.h>
+#include <libavutil/intreadwrite.h>
+
+#include "audio_header.h"
+
+
+static const int mpeg_bit_rates[2][15] = {
+    // MPEG-1 layer III
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    // MPEG-2 and 2.5 layer III
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+};
+
+static const int mpeg_sample_rates[3] = { 44100, 48000, 32000 };
+
+static const int adts_sample_rates[13] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350,
+};
+
+// ADTS frames averaged for the bit rate of the input
+#define ADTS_MAX_FRAMES 64
+
+// RIFF format tags of the fmt chunk
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+
+// Size of the ID3v2 tag at the start of buf, 0 if there is none.
+static size_t id3v2_size(const uint8_t *buf, size_t size)
+{
+    size_t tag_size;
+
+    if (size < 10 || memcmp(buf, "ID3", 3) != 0 ||
+        ((buf[6] | buf[7] | buf[8] | buf[9]) & 0x80))
+    {
+        return 0;
+    }
+
+    // Syncsafe integer, plus the header and the optional footer
+    tag_size = (size_t)buf[6] << 21 | buf[7] << 14 | buf[8] << 7 | buf[9];
+
+    return tag_size + 10 + (buf[5] & 0x10 ? 10 : 0);
+}
+
+// Fields of an MPEG audio layer III frame header
+typedef struct MP3Frame {
+    int lsf;         // MPEG-2 or 2.5
+    int sample_rate;
+    int channels;
+    int bit_rate;
+    int frame_size;  // in bytes
+    int nb_samples;  // per frame
+} MP3Frame;
+
+static int parse_mp3_frame(uint32_t h, MP3Frame *frame)
+{
+    int version, bit_rate_index, sample_rate_index;
+
+    // Sync, layer III
+    if ((h & 0xFFE00000) != 0xFFE00000 || ((h >> 17) & 3) != 1)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    version           = (h >> 19) & 3; // 0: 2.5, 2: 2, 3: 1
+    bit_rate_index    = (h >> 12) & 15;
+    sample_rate_index = (h >> 10) & 3;
+
+    // Free format isn't supported.
+    if (version == 1 || bit_rate_index == 0 || bit_rate_index == 15 || sample_rate_index == 3)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    frame->lsf         = version != 3;
+    frame->sample_rate = mpeg_sample_rates[sample_rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    frame->channels    = ((h >> 6) & 3) == 3 ? 1 : 2;
+    frame->bit_rate    = mpeg_bit_rates[frame->lsf][bit_rate_index] * 1000;
+    frame->nb_samples  = frame->lsf ? 576 : 1152;
+    frame->frame_size  = frame->nb_samples / 8 * frame->bit_rate / frame->sample_rate + ((h >> 9) & 1);
+
+    return 0;
+}
+
+static int parse_mp3(const uint8_t *buf, size_t size, size_t total_size, AudioHeader *header)
+{
+    size_t start = id3v2_size(buf, size);
+    size_t audio_size, tag;
+    MP3Frame frame, next;
+    int64_t nb_samples = 0, nb_bytes = 0;
+    uint32_t flags;
+
+    if (start + 4 > size || parse_mp3_frame(AV_RB32(buf + start), &frame) < 0)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    // A second frame right after the first one, so that random data isn't taken for mp3.
+    if (start + frame.frame_size + 4 > size ||
+        parse_mp3_frame(AV_RB32(buf + start + frame.frame_size), &next) < 0 ||
+        next.sample_rate != frame.sample_rate)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    audio_size = total_size > start ? total_size - start : 0;
+
+    // Xing or Info tag after the side info of the first frame
+    tag = start + 4 + (frame.lsf ? (frame.channels == 1 ? 9 : 17) : (frame.channels == 1 ? 17 : 32));
+    if (tag + 8 <= size && (memcmp(buf + tag, "Xing", 4) == 0 || memcmp(buf + tag, "Info", 4) == 0))
+    {
+        flags = AV_RB32(buf + tag + 4);
+        tag += 8;
+        if ((flags & 0x1) && tag + 4 <= size)
+        {
+            nb_samples = (int64_t)AV_RB32(buf + tag) * frame.nb_samples;
+            tag += 4;
+        }
+        if ((flags & 0x2) && tag + 4 <= size)
+        {
+            nb_bytes = AV_RB32(buf + tag);
+            tag += 4;
+        }
+        tag += (flags & 0x4 ? 100 : 0) + (flags & 0x8 ? 4 : 0);
+
+        // LAME tag: encoder delay and padding, 12 bits each
+        if (nb_samples > 0 && tag + 24 <= size && memcmp(buf + tag, "LAME", 4) == 0)
+        {
+            nb_samples -= (buf[tag + 21] << 4 | buf[tag + 22] >> 4) +
+                          ((buf[tag + 22] & 0xF) << 8 | buf[tag + 23]);
+        }
+    }
+    // VBRI tag, always 32 bytes after the header
+    else if (start + 4 + 32 + 18 <= size && memcmp(buf + start + 4 + 32, "VBRI", 4) == 0)
+    {
+        tag = start + 4 + 32;
+        nb_bytes   = AV_RB32(buf + tag + 10);
+        nb_samples = (int64_t)AV_RB32(buf + tag + 14) * frame.nb_samples;
+    }
+
+    header->format_name = "mp3";
+    header->codec_id    = AV_CODEC_ID_MP3;
+    header->sample_rate = frame.sample_rate;
+    header->channels    = frame.channels;
+
+    if (nb_samples > 0)
+    {
+        header->duration = nb_samples * AV_TIME_BASE / frame.sample_rate;
+        // Under a microsecond of audio leaves the bit rate unknown.
+        if (header->duration > 0)
+        {
+            header->bit_rate = (nb_bytes > 0 ? nb_bytes : (int64_t)audio_size) * 8 * AV_TIME_BASE /
+                               header->duration;
+        }
+    }
+    else
+    {
+        // CBR
+        header->bit_rate = frame.bit_rate;
+        header->duration = (int64_t)audio_size * 8 * AV_TIME_BASE / frame.bit_rate;
+    }
+
+    return 0;
+}
+
+static int parse_adts(const uint8_t *buf, size_t size, size_t total_size, AudioHeader *header)
+{
+    size_t pos = id3v2_size(buf, size);
+    int64_t nb_bytes = 0, nb_samples = 0;
+    int sample_rate_index = -1, channels = 0, nb_frames;
+
+    for (nb_frames = 0; nb_frames < ADTS_MAX_FRAMES && pos + 7 <= size; nb_frames++)
+    {
+        const uint8_t *h = buf + pos;
+        int frame_size;
+
+        // Sync, layer 0
+        if (h[0] != 0xFF || (h[1] & 0xF6) != 0xF0)
+        {
+            break;
+        }
+        if (nb_frames == 0)
+        {
+            sample_rate_index = (h[2] >> 2) & 15;
+            channels          = (h[2] & 1) << 2 | h[3] >> 6;
+        }
+        else if (((h[2] >> 2) & 15) != sample_rate_index)
+        {
+            break;
+        }
+
+        frame_size = (h[3] & 3) << 11 | h[4] << 3 | h[5] >> 5;
+        if (frame_size < 7)
+        {
+            break;
+        }
+
+        nb_bytes   += frame_size;
+        nb_samples += 1024 * ((h[6] & 3) + 1);
+        pos        += frame_size;
+    }
+
+    // Channels in a program config element aren't parsed.
+    if (nb_frames < 2 || sample_rate_index >= 13 || channels == 0)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    header->format_name = "aac";
+    header->codec_id    = AV_CODEC_ID_AAC;
+    header->sample_rate = adts_sample_rates[sample_rate_index];
+    header->channels    = channels == 7 ? 8 : channels;
+    header->bit_rate    = nb_bytes * 8 * header->sample_rate / nb_samples;
+    header->duration    = (int64_t)total_size * 8 * AV_TIME_BASE / header->bit_rate;
+
+    return 0;
+}
+
+static enum AVCodecID wav_codec_id(int format_tag, int bits_per_sample)
+{
+    if (format_tag == WAVE_FORMAT_PCM)
+    {
+        switch (bits_per_sample)
+        {
+        case 8:  return AV_CODEC_ID_PCM_U8;
+        case 16: return AV_CODEC_ID_PCM_S16LE;
+        case 24: return AV_CODEC_ID_PCM_S24LE;
+        case 32: return AV_CODEC_ID_PCM_S32LE;
+        }
+    }
+    else if (format_tag == WAVE_FORMAT_IEEE_FLOAT)
+    {
+        switch (bits_per_sample)
+        {
+        case 32: return AV_CODEC_ID_PCM_F32LE;
+        case 64: return AV_CODEC_ID_PCM_F64LE;
+        }
+    }
+
+    return AV_CODEC_ID_NONE;
+}
+
+static int parse_wav(const uint8_t *buf, size_t size, size_t total_size, AudioHeader *header)
+{
+    size_t pos = 12;
+    int format_tag = 0, channels = 0, sample_rate = 0, byte_rate = 0, bits_per_sample = 0;
+
+    if (size < 12 || memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    while (pos + 8 <= size)
+    {
+        const uint8_t *chunk = buf + pos;
+        size_t chunk_size = AV_RL32(chunk + 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            if (chunk_size < 16 || pos + 8 + chunk_size > size)
+            {
+                return AVERROR_INVALIDDATA;
+            }
+            format_tag      = AV_RL16(chunk + 8);
+            channels        = AV_RL16(chunk + 10);
+            sample_rate     = (int)AV_RL32(chunk + 12);
+            byte_rate       = (int)AV_RL32(chunk + 16);
+            bits_per_sample = AV_RL16(chunk + 22);
+
+            // The format is the first two bytes of the subformat GUID.
+            if (format_tag == WAVE_FORMAT_EXTENSIBLE && chunk_size >= 40)
+            {
+                format_tag = AV_RL16(chunk + 8 + 24);
+            }
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            header->codec_id = wav_codec_id(format_tag, bits_per_sample);
+            if (header->codec_id == AV_CODEC_ID_NONE || channels <= 0 ||
+                sample_rate <= 0 || byte_rate <= 0)
+            {
+                return AVERROR_INVALIDDATA;
+            }
+
+            // Streamed wav files leave the size unset.
+            if (chunk_size == 0 || chunk_size == 0xFFFFFFFF || pos + 8 + chunk_size > total_size)
+            {
+                chunk_size = total_size - (pos + 8);
+            }
+
+            header->format_name = "wav";
+            header->sample_rate = sample_rate;
+            header->channels    = channels;
+            header->bit_rate    = (int64_t)byte_rate * 8;
+            header->duration    = (int64_t)chunk_size * AV_TIME_BASE / byte_rate;
+
+            return 0;
+        }
+
+        // Chunks are padded to an even size.
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    return AVERROR_INVALIDDATA;
+}
+
+static int parse_flac(const uint8_t *buf, size_t size, size_t total_size, AudioHeader *header)
+{
+    size_t start = id3v2_size(buf, size);
+    const uint8_t *info;
+    int64_t nb_samples;
+
+    // The STREAMINFO block comes first.
+    if (start + 8 + 34 > size || memcmp(buf + start, "fLaC", 4) != 0 ||
+        (buf[start + 4] & 0x7F) != 0 || AV_RB24(buf + start + 5) < 34)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+    info = buf + start + 8;
+
+    header->format_name = "flac";
+    header->codec_id    = AV_CODEC_ID_FLAC;
+    header->sample_rate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+    header->channels    = ((info[12] >> 1) & 7) + 1;
+    if (header->sample_rate == 0)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    // 36 bits, 0 if unknown
+    nb_samples = (int64_t)(info[13] & 0xF) << 32 | AV_RB32(info + 14);
+    if (nb_samples > 0)
+    {
+        header->duration = nb_samples * AV_TIME_BASE / header->sample_rate;
+        // A single sample at up to 1048575 Hz is under a microsecond.
+        if (header->duration > 0)
+        {
+            header->bit_rate = (int64_t)total_size * 8 * AV_TIME_BASE / header->duration;
+        }
+    }
+
+    return 0;
+}
+
+int parse_audio_header(const uint8_t *buf, size_t size, size_t total_size, AudioHeader *header)
+{
+    // Cheapest signatures first, the frame syncs last.
+    static int (* const parsers[])(const uint8_t *, size_t, size_t, AudioHeader *) = {
+        parse_wav, parse_flac, parse_mp3, parse_adts,
+    };
+    size_t i;
+
+    for (i = 0; buf && i < sizeof(parsers) / sizeof(parsers[0]); i++)
+    {
+        memset(header, 0, sizeof(AudioHeader));
+        if (parsers[i](buf, size, total_size, header) == 0)
+        {
+            return 0;
+        }
+    }
+
+    memset(header, 0, sizeof(AudioHeader));
+
+    return AVERROR_INVALIDDATA;
+}
@@ -0,0 +1,811 @@
+//
+//  bench.c
+//
+//  Benchmarks of the transcoding library.
+//
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "codec_pool.h"
+#include "transcoding.h"
+#include "transcoding_internal.h"
+
+
+/*
+ Allocation counter: the allocation functions of the whole process, libav*
+ included, are interposed by the ones below, which count the calls and
+ forward them to glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void  __libc_free(void *ptr);
+
+static size_t nb_allocs;
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&nb_allocs, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __sync_fetch_and_add(&nb_allocs, 1);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&nb_allocs, 1);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    __sync_fetch_and_add(&nb_allocs, 1);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+// Used by av_malloc()
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr = memalign(alignment, size);
+
+    if (NULL == ptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+
+    return 0;
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int read_file(const char *path, BufferData *buf)
+{
+    FILE *fp = fopen(path, "rb");
+    if (NULL == fp)
+    {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    buf->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buf->buf = (uint8_t *)malloc(buf->size);
+    if (NULL == buf->buf || fread(buf->buf, buf->size, 1, fp) != 1)
+    {
+        fprintf(stderr, "Could not read %s\n", path);
+        fclose(fp);
+        free(buf->buf);
+        return 1;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ Time to the first finished transcode of a fresh process, with the library
+ initialized explicitly or lazily by the first call, then of a warm call.
+ */
+static int bench_startup(int argc, char **argv)
+{
+    BufferData src_buf, dst_buf;
+    TranscodingArgs args;
+    int out_bit_rate;
+    float out_duration;
+    double t_start, t_init, t_first, t_warm;
+    int lazy;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: bench startup <input file> <format name> [lazy]\n");
+        return 1;
+    }
+    lazy = argc > 2 && strcmp(argv[2], "lazy") == 0;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    args.sample_rate      = 0;
+    args.bit_rate         = 0;
+    args.format_name      = argv[1];
+    args.in_buffer_size   = 0;
+    args.out_buffer_size  = 0;
+    args.shrink_output    = 0;
+    args.in_format_name   = NULL;
+    args.probesize        = 0;
+    args.analyze_duration = 0;
+
+    t_start = now_ms();
+    if (!lazy)
+    {
+        transcoding_global_init();
+    }
+    t_init = now_ms();
+
+    if (transcoding(&dst_buf, &out_bit_rate, &out_duration, args, src_buf))
+    {
+        fprintf(stderr, "First transcode failed.\n");
+        return 1;
+    }
+    t_first = now_ms();
+    transcoding_free_output(&dst_buf);
+
+    if (transcoding(&dst_buf, &out_bit_rate, &out_duration, args, src_buf))
+    {
+        fprintf(stderr, "Warm transcode failed.\n");
+        return 1;
+    }
+    t_warm = now_ms();
+    transcoding_free_output(&dst_buf);
+
+    printf("%-24s %8.3f ms%s\n", "init:", t_init - t_start, lazy ? " (lazy)" : "");
+    printf("%-24s %8.3f ms\n", "time to first transcode:", t_first - t_start);
+    printf("%-24s %8.3f ms\n", "warm transcode:", t_warm - t_first);
+
+    free(src_buf.buf);
+
+    return 0;
+}
+
+/*
+ Warm transcodes of one input, read through the 4 KB AVIO buffer then
+ directly from the source buffer, with the number of read callbacks.
+ */
+static int bench_input(int argc, char **argv)
+{
+    static const char *modes[] = { "4 KB copy", "direct" };
+    TranscodingSession *session = NULL;
+    BufferData src_buf;
+    TranscodingArgs args;
+    JobIO io;
+    JobResult result;
+    double t_start, t_end;
+    int runs, mode, i;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: bench input <input file> <format name> [runs]\n");
+        return 1;
+    }
+    runs = argc > 2 ? atoi(argv[2]) : 10;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    args.sample_rate      = 0;
+    args.bit_rate         = 0;
+    args.format_name      = argv[1];
+    args.in_buffer_size   = 4096;
+    args.out_buffer_size  = 0;
+    args.shrink_output    = 0;
+    args.in_format_name   = NULL;
+    args.probesize        = 0;
+    args.analyze_duration = 0;
+
+    if (transcoding_session_create(&session, args))
+    {
+        fprintf(stderr, "Could not create session.\n");
+        free(src_buf.buf);
+        return 1;
+    }
+
+    for (mode = 0; mode < 2; mode++)
+    {
+        memset(&io, 0, sizeof(JobIO));
+        io.src_buf   = src_buf;
+        io.read_copy = mode == 0;
+
+        t_start = now_ms();
+        for (i = 0; i < runs; i++)
+        {
+            if (transcoding_session_run(session, &io, &result))
+            {
+                fprintf(stderr, "Transcode failed.\n");
+                transcoding_session_destroy(&session);
+                free(src_buf.buf);
+                return 1;
+            }
+            buffer_free(result.bio->buf);
+            buffer_free(result.bio);
+        }
+        t_end = now_ms();
+
+        printf("%-10s %8.3f ms/transcode %10zu read callbacks\n",
+               modes[mode], (t_end - t_start) / runs, result.stats.nb_read_calls);
+    }
+
+    transcoding_session_destroy(&session);
+    free(src_buf.buf);
+
+    return 0;
+}
+
+/*
+ Warm transcodes of one input with the AVIO buffers of both directions at
+ 4 KB, 64 KB, 1 MB and the adaptive size, with the number of callbacks
+ and of output reallocations.
+ */
+static int bench_io(int argc, char **argv)
+{
+    static const int sizes[] = { 4096, 64 * 1024, 1024 * 1024, 0 };
+    TranscodingSession *session = NULL;
+    BufferData src_buf;
+    TranscodingArgs args;
+    JobIO io;
+    JobResult result;
+    double t_start, t_elapsed;
+    int runs, k, i;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: bench io <input file> <format name> [runs]\n");
+        return 1;
+    }
+    runs = argc > 2 ? atoi(argv[2]) : 10;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf = src_buf;
+
+    for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++)
+    {
+        args.sample_rate      = 0;
+        args.bit_rate         = 0;
+        args.format_name      = argv[1];
+        args.in_buffer_size   = sizes[k];
+        args.out_buffer_size  = sizes[k];
+        args.shrink_output    = 0;
+        args.in_format_name   = NULL;
+        args.probesize        = 0;
+        args.analyze_duration = 0;
+
+        if (transcoding_session_create(&session, args))
+        {
+            fprintf(stderr, "Could not create session.\n");
+            free(src_buf.buf);
+            return 1;
+        }
+
+        t_start = now_ms();
+        for (i = 0; i < runs; i++)
+        {
+            if (transcoding_session_run(session, &io, &result))
+            {
+                fprintf(stderr, "Transcode failed.\n");
+                transcoding_session_destroy(&session);
+                free(src_buf.buf);
+                return 1;
+            }
+            buffer_free(result.bio->buf);
+            buffer_free(result.bio);
+        }
+        t_elapsed = (now_ms() - t_start) / runs;
+
+        transcoding_session_destroy(&session);
+
+        if (sizes[k])
+        {
+            printf("%7d KB", sizes[k] / 1024);
+        }
+        else
+        {
+            printf("%10s", "adaptive");
+        }
+        printf(" %8.3f ms %8.2f MB/s %8zu reads %8zu writes %4zu reallocs\n",
+               t_elapsed, src_buf.size / t_elapsed / 1e3, result.stats.nb_read_calls,
+               result.stats.nb_write_calls, result.stats.nb_reallocs);
+    }
+
+    free(src_buf.buf);
+
+    return 0;
+}
+
+/*
+ Error of the output size estimation over a corpus of inputs, the estimate
+ is what the output buffer is first allocated with. With --max-error, it
+ fails if an input fails or if the mean absolute error exceeds the bound,
+ see estimate_check.sh.
+ */
+static int bench_estimate(int argc, char **argv)
+{
+    TranscodingSession *session = NULL;
+    TranscodingStats stats;
+    BufferData src_buf, dst_buf;
+    TranscodingArgs args;
+    int out_bit_rate;
+    float out_duration;
+    double error, sum_error = 0, max_error = 0;
+    int i, first = 1, nb_done = 0, nb_failed = 0;
+
+    if (argc > 1 && strncmp(argv[1], "--max-error=", 12) == 0)
+    {
+        max_error = atof(argv[1] + 12);
+        first = 2;
+    }
+    if (argc <= first)
+    {
+        fprintf(stderr, "Usage: bench estimate <format name> [--max-error=<percent>] <input file>...\n");
+        return 1;
+    }
+
+    args.sample_rate      = 0;
+    args.bit_rate         = 0;
+    args.format_name      = argv[0];
+    args.in_buffer_size   = 0;
+    args.out_buffer_size  = 0;
+    args.shrink_output    = 0;
+    args.in_format_name   = NULL;
+    args.probesize        = 0;
+    args.analyze_duration = 0;
+
+    if (transcoding_session_create(&session, args))
+    {
+        fprintf(stderr, "Could not create session.\n");
+        return 1;
+    }
+
+    printf("%12s %12s %8s %8s  %s\n", "estimate", "output", "error", "reallocs", "input");
+    for (i = first; i < argc; i++)
+    {
+        if (read_file(argv[i], &src_buf))
+        {
+            nb_failed++;
+            continue;
+        }
+        if (transcoding_session_transcode(session, &dst_buf, &out_bit_rate, &out_duration, src_buf))
+        {
+            fprintf(stderr, "Could not transcode %s\n", argv[i]);
+            free(src_buf.buf);
+            nb_failed++;
+            continue;
+        }
+        transcoding_session_get_stats(session, &stats);
+
+        error = 100.0 * ((double)stats.output_estimate - dst_buf.size) / dst_buf.size;
+        sum_error += error < 0 ? -error : error;
+        nb_done++;
+
+        printf("%12zu %12zu %7.1f%% %8zu  %s\n",
+               stats.output_estimate, dst_buf.size, error, stats.nb_reallocs, argv[i]);
+
+        transcoding_free_output(&dst_buf);
+        free(src_buf.buf);
+    }
+
+    if (nb_done > 0)
+    {
+        printf("mean absolute error: %.1f%% over %d inputs\n", sum_error / nb_done, nb_done);
+    }
+
+    transcoding_session_destroy(&session);
+
+    if (max_error > 0)
+    {
+        if (nb_failed > 0 || nb_done == 0)
+        {
+            fprintf(stderr, "FAIL: %d of %d inputs could not be transcoded\n", nb_failed, argc - first);
+            return 1;
+        }
+        if (sum_error / nb_done > max_error)
+        {
+            fprintf(stderr, "FAIL: mean absolute error %.1f%% exceeds %.1f%%\n",
+                    sum_error / nb_done, max_error);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ Warm transcodes of a short clip opened as before, probing the format and
+ searching the stream parameters, then skipping the search when the header
+ has them, then with the header parsed natively, then with the input format
+ given as well.
+ */
+static int bench_probe(int argc, char **argv)
+{
+    static const char *modes[] = { "probe + stream info", "probe", "native header", "format hint" };
+    TranscodingSession *session = NULL;
+    BufferData src_buf;
+    TranscodingArgs args;
+    JobIO io;
+    JobResult result;
+    double t_start, t_elapsed;
+    int runs, mode, i;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: bench probe <input file> <format name> <input format name> [runs]\n");
+        return 1;
+    }
+    runs = argc > 3 ? atoi(argv[3]) : 100;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    for (mode = 0; mode < 4; mode++)
+    {
+        args.sample_rate      = 0;
+        args.bit_rate         = 0;
+        args.format_name      = argv[1];
+        args.in_buffer_size   = 0;
+        args.out_buffer_size  = 0;
+        args.shrink_output    = 0;
+        args.in_format_name   = mode == 3 ? argv[2] : NULL;
+        args.probesize        = 0;
+        args.analyze_duration = 0;
+
+        if (transcoding_session_create(&session, args))
+        {
+            fprintf(stderr, "Could not create session.\n");
+            free(src_buf.buf);
+            return 1;
+        }
+
+        memset(&io, 0, sizeof(JobIO));
+        io.src_buf          = src_buf;
+        io.find_stream_info = mode == 0;
+        io.probe_format     = mode <= 1;
+
+        t_start = now_ms();
+        for (i = 0; i < runs; i++)
+        {
+            if (transcoding_session_run(session, &io, &result))
+            {
+                fprintf(stderr, "Transcode failed.\n");
+                transcoding_session_destroy(&session);
+                free(src_buf.buf);
+                return 1;
+            }
+            buffer_free(result.bio->buf);
+            buffer_free(result.bio);
+        }
+        t_elapsed = (now_ms() - t_start) / runs;
+
+        transcoding_session_destroy(&session);
+
+        printf("%-20s %8.3f ms/transcode\n", modes[mode], t_elapsed);
+    }
+
+    free(src_buf.buf);
+
+    return 0;
+}
+
+/*
+ Warm jobs of an input already in the target codec, transcoded again, then
+ remuxed or copied as is, with the output sizes.
+ */
+static int bench_passthrough(int argc, char **argv)
+{
+    static const char *modes[] = { "transcode", "passthrough" };
+    TranscodingSession *session = NULL;
+    BufferData src_buf;
+    TranscodingArgs args;
+    JobIO io;
+    JobResult result;
+    double t_start, t_elapsed;
+    size_t output_size = 0;
+    int runs, mode, i;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: bench passthrough <input file> <format name> [bit rate] [runs]\n");
+        return 1;
+    }
+    runs = argc > 3 ? atoi(argv[3]) : 20;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    args.sample_rate      = 0;
+    args.bit_rate         = argc > 2 ? atoll(argv[2]) : 0;
+    args.format_name      = argv[1];
+    args.in_buffer_size   = 0;
+    args.out_buffer_size  = 0;
+    args.shrink_output    = 0;
+    args.in_format_name   = NULL;
+    args.probesize        = 0;
+    args.analyze_duration = 0;
+
+    if (transcoding_session_create(&session, args))
+    {
+        fprintf(stderr, "Could not create session.\n");
+        free(src_buf.buf);
+        return 1;
+    }
+
+    for (mode = 0; mode < 2; mode++)
+    {
+        memset(&io, 0, sizeof(JobIO));
+        io.src_buf          = src_buf;
+        io.transcode_always = mode == 0;
+
+        t_start = now_ms();
+        for (i = 0; i < runs; i++)
+        {
+            if (transcoding_session_run(session, &io, &result))
+            {
+                fprintf(stderr, "Transcode failed.\n");
+                transcoding_session_destroy(&session);
+                free(src_buf.buf);
+                return 1;
+            }
+            output_size = result.bio->size;
+            buffer_free(result.bio->buf);
+            buffer_free(result.bio);
+        }
+        t_elapsed = (now_ms() - t_start) / runs;
+
+        printf("%-12s %10.3f ms/job %10zu bytes\n", modes[mode], t_elapsed, output_size);
+    }
+
+    transcoding_session_destroy(&session);
+    free(src_buf.buf);
+
+    return 0;
+}
+
+/*
+ Allocations of warm jobs, per job and per second of audio. Once the decode
+ and convert loop allocates nothing, the per second count is only what the
+ demuxer and the codecs allocate for their packets.
+ */
+static int bench_allocs(int argc, char **argv)
+{
+    TranscodingSession *session = NULL;
+    BufferData src_buf;
+    TranscodingArgs args;
+    JobIO io;
+    JobResult result;
+    size_t nb_before, nb_job_allocs = 0;
+    double duration = 0;
+    int out_bit_rate;
+    float out_duration;
+    int runs, i;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: bench allocs <input file> <format name> [runs]\n");
+        return 1;
+    }
+    runs = argc > 2 ? atoi(argv[2]) : 10;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    args.sample_rate      = 0;
+    args.bit_rate         = 0;
+    args.format_name      = argv[1];
+    args.in_buffer_size   = 0;
+    args.out_buffer_size  = 0;
+    args.shrink_output    = 0;
+    args.in_format_name   = NULL;
+    args.probesize        = 0;
+    args.analyze_duration = 0;
+
+    if (transcoding_session_create(&session, args))
+    {
+        fprintf(stderr, "Could not create session.\n");
+        free(src_buf.buf);
+        return 1;
+    }
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf          = src_buf;
+    io.transcode_always = 1;
+
+    // The first run sets up the session and the pools, it isn't counted.
+    for (i = -1; i < runs; i++)
+    {
+        nb_before = nb_allocs;
+        if (transcoding_session_run(session, &io, &result))
+        {
+            fprintf(stderr, "Transcode failed.\n");
+            transcoding_session_destroy(&session);
+            free(src_buf.buf);
+            return 1;
+        }
+        if (i >= 0)
+        {
+            nb_job_allocs += nb_allocs - nb_before;
+            get_job_output_info(result.bio->size, &result, &out_bit_rate, &out_duration);
+            duration += out_duration;
+        }
+        buffer_free(result.bio->buf);
+        buffer_free(result.bio);
+    }
+
+    transcoding_session_destroy(&session);
+    free(src_buf.buf);
+
+    printf("%10.1f allocations/job\n", (double)nb_job_allocs / runs);
+    printf("%10.1f allocations/s of audio\n", duration > 0 ? nb_job_allocs / duration : 0);
+
+    return 0;
+}
+
+/*
+ One-shot transcodes with the encoder pool disabled, then enabled, then the
+ jobs of one session, with the time per job and the encoder pool hits,
+ misses and discards of each. A session keeps only an encoder that can be
+ flushed, it opens the others again for every job.
+ */
+static int bench_pool(int argc, char **argv)
+{
+    static const char *modes[] = { "cold", "pooled", "session" };
+    TranscodingSession *session = NULL;
+    BufferData src_buf, dst_buf;
+    TranscodingArgs args;
+    CodecPoolStats before, after;
+    int out_bit_rate;
+    float out_duration;
+    double t_start;
+    int runs, mode, i;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: bench pool <input file> <format name> [runs]\n");
+        return 1;
+    }
+    runs = argc > 2 ? atoi(argv[2]) : 20;
+
+    if (read_file(argv[0], &src_buf))
+    {
+        return 1;
+    }
+
+    args.sample_rate      = 0;
+    args.bit_rate         = 0;
+    args.format_name      = argv[1];
+    args.in_buffer_size   = 0;
+    args.out_buffer_size  = 0;
+    args.shrink_output    = 0;
+    args.in_format_name   = NULL;
+    args.probesize        = 0;
+    args.analyze_duration = 0;
+
+    if (transcoding_session_create(&session, args))
+    {
+        fprintf(stderr, "Could not create session.\n");
+        free(src_buf.buf);
+        return 1;
+    }
+
+    for (mode = 0; mode < 3; mode++)
+    {
+        if (mode == 0)
+        {
+            encoder_pool_set_limits(0, 0);
+        }
+        else
+        {
+            encoder_pool_set_limits(4, 64);
+        }
+
+        // The first run of each mode warms the library up, and the pool, it isn't counted.
+        for (i = -1; i < runs; i++)
+        {
+            if (i == 0)
+            {
+                encoder_pool_get_stats(&before);
+                t_start = now_ms();
+            }
+            if (mode < 2 ? transcoding(&dst_buf, &out_bit_rate, &out_duration, args, src_buf)
+                         : transcoding_session_transcode(session, &dst_buf, &out_bit_rate,
+                                                         &out_duration, src_buf))
+            {
+                fprintf(stderr, "Transcode failed.\n");
+                transcoding_session_destroy(&session);
+                free(src_buf.buf);
+                return 1;
+            }
+            transcoding_free_output(&dst_buf);
+        }
+        encoder_pool_get_stats(&after);
+
+        printf("%-8s %8.3f ms/job  encoder pool: %llu hits, %llu misses, %llu discarded\n",
+               modes[mode], (now_ms() - t_start) / runs,
+               (unsigned long long)(after.hits - before.hits),
+               (unsigned long long)(after.misses - before.misses),
+               (unsigned long long)(after.discarded - before.discarded));
+    }
+
+    transcoding_session_destroy(&session);
+    free(src_buf.buf);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "startup") == 0)
+    {
+        return bench_startup(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "input") == 0)
+    {
+        return bench_input(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "io") == 0)
+    {
+        return bench_io(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "estimate") == 0)
+    {
+        return bench_estimate(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "probe") == 0)
+    {
+        return bench_probe(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "passthrough") == 0)
+    {
+        return bench_passthrough(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "allocs") == 0)
+    {
+        return bench_allocs(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "pool") == 0)
+    {
+        return bench_pool(argc - 2, argv + 2);
+    }
+
+    fprintf(stderr, "Usage: %s startup <input file> <format name> [lazy]\n", argv[0]);
+    fprintf(stderr, "       %s input <input file> <format name> [runs]\n", argv[0]);
+    fprintf(stderr, "       %s io <input file> <format name> [runs]\n", argv[0]);
+    fprintf(stderr, "       %s estimate <format name> <input file>...\n", argv[0]);
+    fprintf(stderr, "       %s probe <input file> <format name> <input format name> [runs]\n", argv[0]);
+    fprintf(stderr, "       %s passthrough <input file> <format name> [bit rate] [runs]\n", argv[0]);
+    fprintf(stderr, "       %s allocs <input file> <format name> [runs]\n", argv[0]);
+    fprintf(stderr, "       %s pool <input file> <format name> [runs]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,560 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+
+#include "codec_pool.h"
+
+
+// One idle context and the key it has been opened with.
+typedef struct PoolEntry {
+    struct PoolEntry *next;
+    void             *ctx;
+    uint8_t           key[];
+} PoolEntry;
+
+/*
+ A pool of idle contexts, the most recently returned first.
+ Keys are compared bytewise.
+ */
+typedef struct ContextPool {
+    pthread_mutex_t lock;
+    size_t          key_size;
+    void          (*free_ctx)(void **ctx);
+    PoolEntry      *idle;
+    size_t          max_idle_per_key;
+    size_t          max_idle_total;
+    CodecPoolStats  stats;
+} ContextPool;
+
+
+static void free_codec_context(void **ctx)
+{
+    avcodec_free_context((AVCodecContext **)ctx);
+}
+
+static void free_resampler(void **ctx)
+{
+    swr_free((SwrContext **)ctx);
+}
+
+static ContextPool encoder_pool = {
+    .lock             = PTHREAD_MUTEX_INITIALIZER,
+    .key_size         = sizeof(EncoderKey),
+    .free_ctx         = &free_codec_context,
+    .max_idle_per_key = 4,
+    .max_idle_total   = 64,
+};
+
+static ContextPool decoder_pool = {
+    .lock             = PTHREAD_MUTEX_INITIALIZER,
+    .key_size         = sizeof(DecoderKey),
+    .free_ctx         = &free_codec_context,
+    .max_idle_per_key = 4,
+    .max_idle_total   = 64,
+};
+
+static ContextPool resampler_pool = {
+    .lock             = PTHREAD_MUTEX_INITIALIZER,
+    .key_size         = sizeof(ResamplerKey),
+    .free_ctx         = &free_resampler,
+    .max_idle_per_key = 4,
+    .max_idle_total   = 64,
+};
+
+
+// Free a list of entries detached from a pool, must be called without holding the lock.
+static void pool_free_entries(ContextPool *pool, PoolEntry *entry)
+{
+    while (entry)
+    {
+        PoolEntry *next = entry->next;
+        pool->free_ctx(&entry->ctx);
+        av_free(entry);
+        entry = next;
+    }
+}
+
+// Detach the least recently returned entries beyond the total limit, lock must be held.
+static PoolEntry *pool_trim_locked(ContextPool *pool)
+{
+    PoolEntry **pp = &pool->idle;
+    PoolEntry *evicted, *entry;
+    size_t i;
+
+    if (pool->stats.idle <= pool->max_idle_total)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < pool->max_idle_total; i++)
+    {
+        pp = &(*pp)->next;
+    }
+    evicted = *pp;
+    *pp = NULL;
+
+    for (entry = evicted; entry; entry = entry->next)
+    {
+        pool->stats.idle--;
+        pool->stats.discarded++;
+    }
+
+    return evicted;
+}
+
+// Take an idle context with the given key out of the pool, NULL if there is none.
+static void *pool_take(ContextPool *pool, const void *key)
+{
+    PoolEntry **pp, *entry = NULL;
+    void *ctx = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (pp = &pool->idle; *pp; pp = &(*pp)->next)
+    {
+        if (memcmp((*pp)->key, key, pool->key_size) == 0)
+        {
+            entry = *pp;
+            *pp = entry->next;
+            break;
+        }
+    }
+    if (entry)
+    {
+        pool->stats.hits++;
+        pool->stats.idle--;
+    }
+    else
+    {
+        pool->stats.misses++;
+    }
+    pool->stats.in_use++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (entry)
+    {
+        ctx = entry->ctx;
+        av_free(entry);
+    }
+
+    return ctx;
+}
+
+/*
+ Give a checked out context back to the pool, it's freed if the pool is full.
+ Pass NULL if the context has been freed by the caller.
+ */
+static void pool_put(ContextPool *pool, const void *key, void *ctx)
+{
+    PoolEntry *entry = NULL, *evicted = NULL, *it;
+    size_t same_key = 0;
+    int pooled = 0;
+
+    if (ctx)
+    {
+        entry = (PoolEntry *)av_malloc(sizeof(PoolEntry) + pool->key_size);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.in_use--;
+
+    if (entry)
+    {
+        for (it = pool->idle; it; it = it->next)
+        {
+            if (memcmp(it->key, key, pool->key_size) == 0)
+            {
+                same_key++;
+            }
+        }
+
+        if (same_key < pool->max_idle_per_key && pool->max_idle_total > 0)
+        {
+            memcpy(entry->key, key, pool->key_size);
+            entry->ctx  = ctx;
+            entry->next = pool->idle;
+            pool->idle  = entry;
+            pool->stats.idle++;
+
+            evicted = pool_trim_locked(pool);
+            pooled  = 1;
+        }
+    }
+
+    if (!pooled)
+    {
+        pool->stats.discarded++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!pooled)
+    {
+        if (ctx)
+        {
+            pool->free_ctx(&ctx);
+        }
+        av_free(entry);
+    }
+    pool_free_entries(pool, evicted);
+}
+
+static void pool_set_limits(ContextPool *pool, size_t max_idle_per_key, size_t max_idle_total)
+{
+    PoolEntry *evicted;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->max_idle_per_key = max_idle_per_key;
+    pool->max_idle_total   = max_idle_total;
+    evicted = pool_trim_locked(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_free_entries(pool, evicted);
+}
+
+static void pool_get_stats(ContextPool *pool, CodecPoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_clear(ContextPool *pool)
+{
+    PoolEntry *evicted;
+
+    pthread_mutex_lock(&pool->lock);
+    evicted = pool->idle;
+    pool->idle = NULL;
+    pool->stats.idle = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_free_entries(pool, evicted);
+}
+
+
+int flush_encoder(AVCodecContext *encoder)
+{
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    if (encoder->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+    {
+        avcodec_flush_buffers(encoder);
+        return 0;
+    }
+#endif
+
+    // Encoders without delay don't keep any samples between frames.
+    if (!(encoder->codec->capabilities & AV_CODEC_CAP_DELAY))
+    {
+        return 0;
+    }
+
+    /*
+     The others, e.g. libmp3lame, libfdk_aac and libopus, can't take frames
+     once drained. Reopening a closed context isn't supported by libavcodec,
+     so they can't be reused.
+     */
+    return AVERROR(ENOSYS);
+}
+
+int encoder_pool_acquire(const EncoderKey *key, const AVCodec *codec, AVCodecContext **p_encoder)
+{
+    int error;
+    AVCodecContext *avctx;
+
+    avctx = (AVCodecContext *)pool_take(&encoder_pool, key);
+    if (avctx)
+    {
+        *p_encoder = avctx;
+        return 0;
+    }
+
+    avctx = avcodec_alloc_context3(codec);
+    if (!avctx)
+    {
+        fprintf(stderr, "Could not allocate an encoding context.\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    avctx->sample_fmt     = key->sample_fmt;
+    avctx->sample_rate    = key->sample_rate;
+    avctx->channels       = key->channels;
+    avctx->channel_layout = key->channel_layout;
+    avctx->flags         |= key->flags;
+    if (key->bit_rate > 0)
+    {
+        avctx->bit_rate = key->bit_rate;
+    }
+
+    // Open the encoder for the audio stream to use it later.
+    error = avcodec_open2(avctx, codec, NULL);
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not open output codec.\n");
+        goto cleanup;
+    }
+
+    *p_encoder = avctx;
+
+    return 0;
+
+cleanup:
+    avcodec_free_context(&avctx);
+    pool_put(&encoder_pool, key, NULL);
+    return error;
+}
+
+void encoder_pool_release(const EncoderKey *key, AVCodecContext **p_encoder)
+{
+    if (NULL == p_encoder || NULL == *p_encoder)
+    {
+        return;
+    }
+
+    if (flush_encoder(*p_encoder) < 0)
+    {
+        avcodec_free_context(p_encoder);
+    }
+
+    pool_put(&encoder_pool, key, *p_encoder);
+    *p_encoder = NULL;
+}
+
+void encoder_pool_set_limits(size_t max_idle_per_key, size_t max_idle_total)
+{
+    pool_set_limits(&encoder_pool, max_idle_per_key, max_idle_total);
+}
+
+void encoder_pool_get_stats(CodecPoolStats *stats)
+{
+    pool_get_stats(&encoder_pool, stats);
+}
+
+void encoder_pool_clear(void)
+{
+    pool_clear(&encoder_pool);
+}
+
+// Threads of the decoders that decode frames in parallel
+#define DECODER_FRAME_THREADS 2
+
+// Fill the decoder key of a stream, the codec id is left NONE if it can't be pooled.
+static void init_decoder_key(DecoderKey *key, const AVCodecParameters *par)
+{
+    memset(key, 0, sizeof(DecoderKey));
+
+    if (par->extradata_size > DECODER_KEY_MAX_EXTRADATA)
+    {
+        return;
+    }
+
+    key->codec_id              = par->codec_id;
+    key->sample_fmt            = par->format;
+    key->sample_rate           = par->sample_rate;
+    key->channels              = par->channels;
+    key->channel_layout        = par->channel_layout;
+    key->block_align           = par->block_align;
+    key->bits_per_coded_sample = par->bits_per_coded_sample;
+    key->extradata_size        = par->extradata_size;
+    if (par->extradata_size > 0)
+    {
+        memcpy(key->extradata, par->extradata, par->extradata_size);
+    }
+
+    /*
+     Some of audio formats, such as *.wav whose codec is pcm_s16le,
+     have no infomation on channel layout, we need to set it manually in case aborting.
+    */
+    if (key->channel_layout == 0)
+    {
+        key->channel_layout = av_get_default_channel_layout(par->channels);
+    }
+}
+
+int decoder_pool_acquire(const AVCodecParameters *par, const AVCodec *codec,
+                         DecoderKey *key, AVCodecContext **p_decoder)
+{
+    int error;
+    AVCodecContext *avctx = NULL;
+
+    init_decoder_key(key, par);
+
+    if (key->codec_id != AV_CODEC_ID_NONE)
+    {
+        avctx = (AVCodecContext *)pool_take(&decoder_pool, key);
+        if (avctx)
+        {
+            *p_decoder = avctx;
+            return 0;
+        }
+    }
+
+    // allocate a new decoding context
+    avctx = avcodec_alloc_context3(codec);
+    if (!avctx)
+    {
+        fprintf(stderr, "Could not allocate a decoding context.\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    // initialize the stream parameters with demuxer information
+    error = avcodec_parameters_to_context(avctx, par);
+    if (error < 0)
+    {
+        goto cleanup;
+    }
+
+    if (avctx->channel_layout == 0)
+    {
+        avctx->channel_layout = av_get_default_channel_layout(par->channels);
+    }
+
+    /*
+     Decoders that decode several frames in parallel, e.g. flac, get a few
+     threads, the decode loop keeps them fed. Not more, as jobs run side by side.
+     */
+    if (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS)
+    {
+        avctx->thread_type  = FF_THREAD_FRAME;
+        avctx->thread_count = DECODER_FRAME_THREADS;
+    }
+
+    error = avcodec_open2(avctx, codec, NULL);
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not open input codec.\n");
+        goto cleanup;
+    }
+
+    *p_decoder = avctx;
+
+    return 0;
+
+cleanup:
+    avcodec_free_context(&avctx);
+    if (key->codec_id != AV_CODEC_ID_NONE)
+    {
+        pool_put(&decoder_pool, key, NULL);
+    }
+    return error;
+}
+
+void decoder_pool_release(const DecoderKey *key, AVCodecContext **p_decoder)
+{
+    if (NULL == p_decoder || NULL == *p_decoder)
+    {
+        return;
+    }
+
+    if (key->codec_id == AV_CODEC_ID_NONE)
+    {
+        avcodec_free_context(p_decoder);
+        return;
+    }
+
+    avcodec_flush_buffers(*p_decoder);
+
+    pool_put(&decoder_pool, key, *p_decoder);
+    *p_decoder = NULL;
+}
+
+void decoder_pool_set_limits(size_t max_idle_per_key, size_t max_idle_total)
+{
+    pool_set_limits(&decoder_pool, max_idle_per_key, max_idle_total);
+}
+
+void decoder_pool_get_stats(CodecPoolStats *stats)
+{
+    pool_get_stats(&decoder_pool, stats);
+}
+
+void decoder_pool_clear(void)
+{
+    pool_clear(&decoder_pool);
+}
+
+int resampler_pool_acquire(const ResamplerKey *key, SwrContext **p_resampler)
+{
+    int error;
+    SwrContext *swr;
+
+    swr = (SwrContext *)pool_take(&resampler_pool, key);
+    if (swr)
+    {
+        *p_resampler = swr;
+        return 0;
+    }
+
+    swr = swr_alloc();
+    if (!swr)
+    {
+        fprintf(stderr, "Could not allocate resample context.\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    av_opt_set_int(swr, "in_sample_rate", key->in_sample_rate, 0);
+    av_opt_set_sample_fmt(swr, "in_sample_fmt", key->in_sample_fmt, 0);
+    av_opt_set_channel_layout(swr, "in_channel_layout", key->in_channel_layout, 0);
+
+    av_opt_set_int(swr, "out_sample_rate", key->out_sample_rate, 0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt", key->out_sample_fmt, 0);
+    av_opt_set_channel_layout(swr, "out_channel_layout", key->out_channel_layout, 0);
+
+    // Open the resampler with the specified parameters.
+    error = swr_init(swr);
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not open resample context.\n");
+        goto cleanup;
+    }
+
+    *p_resampler = swr;
+
+    return 0;
+
+cleanup:
+    swr_free(&swr);
+    pool_put(&resampler_pool, key, NULL);
+    return error;
+}
+
+void resampler_pool_release(const ResamplerKey *key, SwrContext **p_resampler)
+{
+    if (NULL == p_resampler || NULL == *p_resampler)
+    {
+        return;
+    }
+
+    /*
+     Re-initializing drops the buffered samples and keeps the filter bank
+     as the parameters didn't change.
+     */
+    if (swr_init(*p_resampler) < 0)
+    {
+        swr_free(p_resampler);
+    }
+
+    pool_put(&resampler_pool, key, *p_resampler);
+    *p_resampler = NULL;
+}
+
+void resampler_pool_set_limits(size_t max_idle_per_key, size_t max_idle_total)
+{
+    pool_set_limits(&resampler_pool, max_idle_per_key, max_idle_total);
+}
+
+void resampler_pool_get_stats(CodecPoolStats *stats)
+{
+    pool_get_stats(&resampler_pool, stats);
+}
+
+void resampler_pool_clear(void)
+{
+    pool_clear(&resampler_pool);
+}
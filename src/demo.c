@@ -6,6 +6,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "transcoding.h"
 
@@ -37,6 +38,12 @@ int main(int argc, char **argv) {
         TranscodingArgs args;
         args.sample_rate = 48000;
         args.bit_rate = 32000;
+        args.in_buffer_size = 0;
+        args.out_buffer_size = 0;
+        args.shrink_output = 0;
+        args.in_format_name = NULL;
+        args.probesize = 0;
+        args.analyze_duration = 0;
 
         int i = 0;
         int dot = 0;
@@ -54,7 +61,11 @@ int main(int argc, char **argv) {
 
         int out_bit_rate; 
         float out_duration;
-        transcoding(&dst_buf, args, src_buf);
+        if (transcoding(&dst_buf, &out_bit_rate, &out_duration, args, src_buf) < 0) {
+            fprintf(stderr, "Could not transcode %s\n", argv[1]);
+            free(src_buf.buf);
+            return 1;
+        }
 
         printf("out bit rate: %d\n", out_bit_rate);
         printf("out duration: %f\n", out_duration);
@@ -64,7 +75,7 @@ int main(int argc, char **argv) {
         fclose(dst_file);
 
         free(src_buf.buf);
-        free(dst_buf.buf);
+        transcoding_free_output(&dst_buf);
 
         return 0;
     }
@@ -1,9 +1,168 @@
+#define _GNU_SOURCE // mremap()
+
 #include "io_in_memory.h"
 
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <libavformat/avio.h>
 #include <libavformat/avformat.h>
 
 
+/*
+ The default allocator puts a header before every buffer. Large buffers are
+ mapped instead of allocated by av_malloc(), so that they grow by mremap()
+ without copying their data.
+ */
+typedef struct BufferHeader {
+    size_t size;   /// size of the buffer, without the header
+    size_t mapped; /// length of the mapping, 0 if allocated by av_malloc()
+} BufferHeader;
+
+// Keeps the buffer aligned as by av_malloc()
+#define BUFFER_HEADER_SIZE 64
+
+#ifdef MREMAP_MAYMOVE
+#define BUFFER_MMAP_THRESHOLD (1024 * 1024)
+#endif
+
+#define BUFFER_HEADER(ptr) ((BufferHeader *)((uint8_t *)(ptr) - BUFFER_HEADER_SIZE))
+#define BUFFER_DATA(header) ((uint8_t *)(header) + BUFFER_HEADER_SIZE)
+
+#ifdef BUFFER_MMAP_THRESHOLD
+static size_t mapping_length(size_t size) {
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + BUFFER_HEADER_SIZE + page - 1) / page * page;
+}
+#endif
+
+static void *default_alloc(void *opaque, size_t size) {
+
+    BufferHeader *header;
+
+    (void)opaque;
+
+#ifdef BUFFER_MMAP_THRESHOLD
+    if (size >= BUFFER_MMAP_THRESHOLD) {
+        size_t length = mapping_length(size);
+
+        header = (BufferHeader *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (header == MAP_FAILED) {
+            return NULL;
+        }
+        header->mapped = length;
+    }
+    else
+#endif
+    {
+        header = (BufferHeader *)av_malloc(size + BUFFER_HEADER_SIZE);
+        if (NULL == header) {
+            return NULL;
+        }
+        header->mapped = 0;
+    }
+    header->size = size;
+
+    return BUFFER_DATA(header);
+}
+
+static void *default_realloc(void *opaque, void *ptr, size_t size) {
+
+    BufferHeader *header = BUFFER_HEADER(ptr);
+
+#ifdef BUFFER_MMAP_THRESHOLD
+    if (header->mapped) {
+        // the pages are moved, not copied
+        size_t length = mapping_length(size);
+
+        header = (BufferHeader *)mremap(header, header->mapped, length, MREMAP_MAYMOVE);
+        if (header == MAP_FAILED) {
+            return NULL;
+        }
+        header->mapped = length;
+        header->size = size;
+
+        return BUFFER_DATA(header);
+    }
+    if (size >= BUFFER_MMAP_THRESHOLD) {
+        // copied once to a mapping, which then grows without copies
+        uint8_t *new_ptr = (uint8_t *)default_alloc(opaque, size);
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, FFMIN(header->size, size));
+            av_free(header);
+        }
+
+        return new_ptr;
+    }
+#endif
+
+    header = (BufferHeader *)av_realloc(header, size + BUFFER_HEADER_SIZE);
+    if (NULL == header) {
+        return NULL;
+    }
+    header->size = size;
+
+    return BUFFER_DATA(header);
+}
+
+static void default_free(void *opaque, void *ptr) {
+
+    BufferHeader *header = BUFFER_HEADER(ptr);
+
+    (void)opaque;
+
+#ifdef BUFFER_MMAP_THRESHOLD
+    if (header->mapped) {
+        munmap(header, header->mapped);
+        return;
+    }
+#endif
+    av_free(header);
+}
+
+static TranscodingAllocator buffer_allocator = {
+    .alloc   = &default_alloc,
+    .realloc = &default_realloc,
+    .free    = &default_free,
+    .opaque  = NULL,
+};
+
+void buffer_set_allocator(const TranscodingAllocator *allocator) {
+
+    if (allocator) {
+        buffer_allocator = *allocator;
+    }
+    else {
+        buffer_allocator.alloc   = &default_alloc;
+        buffer_allocator.realloc = &default_realloc;
+        buffer_allocator.free    = &default_free;
+        buffer_allocator.opaque  = NULL;
+    }
+}
+
+void *buffer_alloc(size_t size) {
+    return buffer_allocator.alloc(buffer_allocator.opaque, size);
+}
+
+void *buffer_realloc(void *ptr, size_t size) {
+
+    if (NULL == ptr) {
+        return buffer_alloc(size);
+    }
+    return buffer_allocator.realloc(buffer_allocator.opaque, ptr, size);
+}
+
+void buffer_free(void *ptr) {
+
+    if (ptr) {
+        buffer_allocator.free(buffer_allocator.opaque, ptr);
+    }
+}
+
 int init_io_context_custom(AVFormatContext *fmt_ctx,
                            int buffer_size,
                            int write_flag,
@@ -33,6 +192,16 @@ int init_io_context_custom(AVFormatContext *fmt_ctx,
 }
 
 
+void free_io_context(AVIOContext **pb) {
+
+    if (pb && *pb) {
+        // avio_closep() would close opaque as an URLContext
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+}
+
+
 static int m_read_packet(void *opaque, uint8_t *buf, int buf_size);
 static int m_write_packet(void *opaque, uint8_t *buf, int buf_size);
 static int64_t m_seek(void *opaque, int64_t offset, int whence);
@@ -40,18 +209,72 @@ static int64_t m_seek(void *opaque, int64_t offset, int whence);
 
 int init_io_context_default(AVFormatContext *fmt_ctx, int write_flag, BufferIO *bio) {
 
-    return init_io_context_custom(fmt_ctx, 4096, write_flag, bio, &m_read_packet, &m_write_packet, &m_seek);
+    return init_io_context_sized(fmt_ctx, 4096, write_flag, bio);
+
+}
+int init_io_context_sized(AVFormatContext *fmt_ctx, int buffer_size, int write_flag, BufferIO *bio) {
+
+    return init_io_context_custom(fmt_ctx, buffer_size, write_flag, bio, &m_read_packet, &m_write_packet, &m_seek);
+
+}
+int init_io_context_direct(AVFormatContext *fmt_ctx, int buffer_size, BufferIO *bio) {
+
+    int error = init_io_context_custom(fmt_ctx, buffer_size, 0, bio, &m_read_packet, NULL, &m_seek);
+    if (error == 0) {
+        // avio_read() then calls m_read_packet() with the caller's destination
+        fmt_ctx->pb->direct = 1;
+    }
+
+    return error;
+}
+
+// Move the segment cursor to the segment of bio->curr, from where it is.
+static void locate_segment(BufferIO *bio) {
 
+    while (bio->_segment > 0 && bio->curr < bio->_segment_start) {
+        bio->_segment--;
+        bio->_segment_start -= bio->segments[bio->_segment].size;
+    }
+    while (bio->_segment < bio->nb_segments - 1 &&
+           bio->curr >= bio->_segment_start + bio->segments[bio->_segment].size) {
+        bio->_segment_start += bio->segments[bio->_segment].size;
+        bio->_segment++;
+    }
 }
 
 static int m_read_packet(void *opaque, uint8_t *buf, int buf_size) {
 
     BufferIO *bio = (BufferIO *)opaque;
-    int left_size = (int)(bio->size - bio->curr);
-    buf_size = FFMIN(buf_size, left_size);
+    size_t left_size = bio->curr < bio->size ? bio->size - bio->curr : 0;
+    buf_size = (int)FFMIN((size_t)buf_size, left_size);
+    if (buf_size <= 0) {
+        return AVERROR_EOF;
+    }
 
-    memcpy(buf, bio->buf + bio->curr, buf_size);
-    bio->curr += buf_size;
+    if (bio->segments) {
+        // copy across as many segments as the read spans
+        int left = buf_size;
+
+        while (left > 0) {
+            const BufferData *segment;
+            size_t offset, n;
+
+            locate_segment(bio);
+            segment = &bio->segments[bio->_segment];
+            offset = bio->curr - bio->_segment_start;
+            n = FFMIN((size_t)left, segment->size - offset);
+
+            memcpy(buf, segment->buf + offset, n);
+            buf += n;
+            left -= (int)n;
+            bio->curr += n;
+        }
+    }
+    else {
+        memcpy(buf, bio->buf + bio->curr, buf_size);
+        bio->curr += buf_size;
+    }
+    bio->nb_calls++;
 
     return buf_size;
 }
@@ -60,26 +283,49 @@ static int m_write_packet(void *opaque, uint8_t *buf, int buf_size) {
 
     BufferIO *bio = (BufferIO *)opaque;
 
-    if (bio->curr + buf_size > bio->_total) {
+    bio->nb_calls++;
 
-        size_t new_total;
-        do {
-            // additional buf_size in case null pointer crash.
-            new_total =  bio->_total * 3 / 2 + buf_size;
-        } while (bio->curr + buf_size > new_total);
+    if (bio->curr + buf_size > bio->_total && (bio->flags & BUFFER_IO_FIXED)) {
 
-        uint8_t *ptr = (uint8_t *)realloc(bio->buf, new_total);
-        if (ptr == NULL) {
-            fprintf(stderr, "Could not alloc memory !");
-            return AVERROR(ENOMEM);
-        }
-        else {
-            bio->buf = ptr;
-            bio->_total = new_total;
+        // keep what fits, the rest only counts in the required size
+        if (bio->curr < bio->_total) {
+            memcpy(bio->buf + bio->curr, buf, bio->_total - bio->curr);
         }
     }
+    else {
+
+        if (bio->curr + buf_size > bio->_total) {
+
+            // double up to a cap, then grow by the cap, so that big outputs
+            // don't carry as much slack as they hold
+            size_t new_total = bio->_total < BUFFER_IO_GROWTH_CAP ?
+                               bio->_total * 2 : bio->_total + BUFFER_IO_GROWTH_CAP;
+            new_total = FFMAX(new_total, bio->curr + buf_size);
 
-    memcpy(bio->buf + bio->curr, buf, buf_size);
+            uint8_t *ptr;
+            if (bio->flags & BUFFER_IO_BORROWED) {
+                ptr = (uint8_t *)buffer_alloc(new_total);
+                if (ptr != NULL) {
+                    memcpy(ptr, bio->buf, bio->size);
+                    bio->flags &= ~BUFFER_IO_BORROWED;
+                }
+            }
+            else {
+                ptr = (uint8_t *)buffer_realloc(bio->buf, new_total);
+            }
+            if (ptr == NULL) {
+                fprintf(stderr, "Could not alloc memory !");
+                return AVERROR(ENOMEM);
+            }
+            else {
+                bio->buf = ptr;
+                bio->_total = new_total;
+                bio->nb_reallocs++;
+            }
+        }
+
+        memcpy(bio->buf + bio->curr, buf, buf_size);
+    }
 
     if (bio->curr + buf_size > bio->size) {
         bio->size = bio->curr + buf_size;
@@ -90,11 +336,178 @@ static int m_write_packet(void *opaque, uint8_t *buf, int buf_size) {
     return buf_size;
 }
 
+int shrink_buffer_io(BufferIO *bio) {
+
+    uint8_t *ptr;
+
+    if ((bio->flags & BUFFER_IO_BORROWED) || bio->size == 0 || bio->size >= bio->_total) {
+        return 0;
+    }
+
+    ptr = (uint8_t *)buffer_realloc(bio->buf, bio->size);
+    if (ptr == NULL) {
+        // keeps the larger buffer
+        return AVERROR(ENOMEM);
+    }
+    bio->buf = ptr;
+    bio->_total = bio->size;
+    bio->nb_reallocs++;
+
+    return 0;
+}
+
+/*
+ Idle chunks of ChunkedIO kept for the next outputs, so that the chunks of
+ an output are released and reused without going back to the allocator.
+ */
+#define CHUNK_POOL_MAX 64
+
+static struct {
+    pthread_mutex_t lock;
+    uint8_t        *chunks[CHUNK_POOL_MAX];
+    int             nb_chunks;
+} chunk_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint8_t *take_chunk(void) {
+
+    uint8_t *chunk = NULL;
+
+    pthread_mutex_lock(&chunk_pool.lock);
+    if (chunk_pool.nb_chunks > 0) {
+        chunk = chunk_pool.chunks[--chunk_pool.nb_chunks];
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+
+    if (NULL == chunk) {
+        chunk = (uint8_t *)buffer_alloc(BUFFER_CHUNK_SIZE);
+    }
+
+    return chunk;
+}
+
+void release_chunk(BufferData *chunk) {
+
+    if (NULL == chunk->buf) {
+        return;
+    }
+
+    pthread_mutex_lock(&chunk_pool.lock);
+    if (chunk_pool.nb_chunks < CHUNK_POOL_MAX) {
+        chunk_pool.chunks[chunk_pool.nb_chunks++] = chunk->buf;
+        chunk->buf = NULL;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+
+    buffer_free(chunk->buf);
+    chunk->buf = NULL;
+    chunk->size = 0;
+}
+
+void release_chunks(BufferData **p_chunks, int nb_chunks) {
+
+    int i;
+
+    if (NULL == *p_chunks) {
+        return;
+    }
+    for (i = 0; i < nb_chunks; i++) {
+        release_chunk(&(*p_chunks)[i]);
+    }
+    buffer_free(*p_chunks);
+    *p_chunks = NULL;
+}
+
+static int c_write_packet(void *opaque, uint8_t *buf, int buf_size) {
+
+    ChunkedIO *cio = (ChunkedIO *)opaque;
+    int left = buf_size;
+
+    cio->nb_calls++;
+
+    while (left > 0) {
+
+        int idx = (int)(cio->curr / BUFFER_CHUNK_SIZE);
+        size_t offset = cio->curr % BUFFER_CHUNK_SIZE;
+        size_t n = FFMIN((size_t)left, BUFFER_CHUNK_SIZE - offset);
+
+        if (idx == cio->nb_chunks) {
+            // a new chunk, the data written so far stays where it is
+            if (cio->nb_chunks == cio->_allocated) {
+                int allocated = FFMAX(cio->_allocated * 2, 16);
+                BufferData *chunks = (BufferData *)buffer_realloc(cio->chunks, allocated * sizeof(BufferData));
+                if (chunks == NULL) {
+                    fprintf(stderr, "Could not alloc memory !");
+                    return AVERROR(ENOMEM);
+                }
+                cio->chunks = chunks;
+                cio->_allocated = allocated;
+            }
+
+            cio->chunks[idx].buf = take_chunk();
+            if (cio->chunks[idx].buf == NULL) {
+                fprintf(stderr, "Could not alloc memory !");
+                return AVERROR(ENOMEM);
+            }
+            cio->chunks[idx].size = 0;
+            cio->nb_chunks++;
+        }
+
+        memcpy(cio->chunks[idx].buf + offset, buf, n);
+        cio->chunks[idx].size = FFMAX(cio->chunks[idx].size, offset + n);
+
+        buf += n;
+        left -= (int)n;
+        cio->curr += n;
+    }
+
+    cio->size = FFMAX(cio->size, cio->curr);
+
+    return buf_size;
+}
+
+static int64_t c_seek(void *opaque, int64_t offset, int whence) {
+    int64_t new_pos = 0;
+    ChunkedIO *cio = (ChunkedIO *)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+
+        case AVSEEK_SIZE:
+            return cio->size;
+
+        case SEEK_SET:
+            new_pos = offset;
+            break;
+        case SEEK_CUR:
+            new_pos = cio->curr + offset;
+            break;
+        case SEEK_END:
+            new_pos = cio->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    // headers rewritten by muxers such as mp4 and wav land in their chunk
+    cio->curr = FFMIN(FFMAX(new_pos, 0), cio->size);
+
+    return cio->curr;
+}
+
+int init_io_context_chunked(AVFormatContext *fmt_ctx, int buffer_size, ChunkedIO *cio) {
+
+    return init_io_context_custom(fmt_ctx, buffer_size, 1, cio, NULL, &c_write_packet, &c_seek);
+}
+
 static int64_t m_seek(void *opaque, int64_t offset, int whence) {
     int64_t new_pos = 0;
     BufferIO *bio = (BufferIO *)opaque;
 
-    switch (whence) {
+    switch (whence & ~AVSEEK_FORCE) {
+
+        case AVSEEK_SIZE:
+            return bio->size;
 
         case SEEK_SET:
             new_pos = offset;
@@ -109,7 +522,10 @@ static int64_t m_seek(void *opaque, int64_t offset, int whence) {
             return AVERROR(EINVAL);
     }
 
-    bio->curr = FFMIN(new_pos, bio->size);
+    if (new_pos < 0) {
+        return AVERROR(EINVAL);
+    }
+    bio->curr = (size_t)FFMIN(new_pos, (int64_t)bio->size);
     
     return bio->curr;
 }
@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/samplefmt.h>
+
+#include "output_estimate.h"
+
+
+// Bytes a container adds to the encoded audio
+typedef struct ContainerOverhead {
+    const char *name;      // muxer name
+    size_t      header;    // headers and trailer, e.g. mp4's moov or flac's padding
+    size_t      per_frame; // framing of every encoded frame
+} ContainerOverhead;
+
+static const ContainerOverhead container_overheads[] = {
+    { "mp3",  4096,  0  }, // ID3v2 and the Xing frame
+    { "adts", 0,     7  },
+    { "ipod", 2048,  8  }, // sample tables
+    { "mp4",  2048,  8  },
+    { "ogg",  8192,  3  }, // codec setup headers, page headers
+    { "opus", 1024,  3  },
+    { "flac", 16384, 16 }, // 8 KB of padding, seek table
+    { "wav",  64,    0  },
+};
+
+static const ContainerOverhead default_overhead = { NULL, 4096, 8 };
+
+// Lossless codecs compress PCM to about this ratio.
+#define LOSSLESS_RATIO 0.6
+
+// Bit rate assumed when neither the encoder nor the codec tells one
+#define DEFAULT_BIT_RATE 128000
+
+// Margin over the estimation, a realloc costs more than some slack.
+#define ESTIMATE_MARGIN 1.05
+
+
+double estimate_input_duration(const AVFormatContext *input_format_context, size_t src_size)
+{
+    const AVStream *stream = input_format_context->streams[0];
+    const AVCodecParameters *codecpar = stream->codecpar;
+    int64_t bit_rate;
+    int bits_per_sample;
+
+    if (stream->duration != AV_NOPTS_VALUE && stream->duration > 0)
+    {
+        return stream->duration * av_q2d(stream->time_base);
+    }
+
+    // Also set by the mp3 demuxer from the Xing or VBRI header.
+    if (input_format_context->duration != AV_NOPTS_VALUE && input_format_context->duration > 0)
+    {
+        return (double)input_format_context->duration / AV_TIME_BASE;
+    }
+
+    bit_rate = input_format_context->bit_rate > 0 ? input_format_context->bit_rate : codecpar->bit_rate;
+    if (bit_rate <= 0)
+    {
+        bits_per_sample = av_get_bits_per_sample(codecpar->codec_id);
+        bit_rate = (int64_t)bits_per_sample * codecpar->sample_rate * codecpar->channels;
+    }
+    if (bit_rate > 0)
+    {
+        return src_size * 8.0 / bit_rate;
+    }
+
+    return 0;
+}
+
+// Bit rate of the encoded audio, before the container.
+static double encoded_bit_rate(const AVCodecContext *encoder)
+{
+    int bits_per_sample = av_get_bits_per_sample(encoder->codec_id);
+
+    if (bits_per_sample > 0)
+    {
+        // PCM
+        return (double)bits_per_sample * encoder->sample_rate * encoder->channels;
+    }
+
+    if (encoder->codec_id == AV_CODEC_ID_FLAC)
+    {
+        bits_per_sample = encoder->bits_per_raw_sample > 0 ? encoder->bits_per_raw_sample :
+                          8 * av_get_bytes_per_sample(encoder->sample_fmt);
+
+        return LOSSLESS_RATIO * bits_per_sample * encoder->sample_rate * encoder->channels;
+    }
+
+    return encoder->bit_rate > 0 ? encoder->bit_rate : DEFAULT_BIT_RATE;
+}
+
+size_t estimate_output_size(const AVFormatContext *input_format_context, size_t src_size,
+                            const AVOutputFormat *output_format, const AVCodecContext *encoder)
+{
+    const ContainerOverhead *overhead = &default_overhead;
+    double duration, nb_frames, bytes;
+    int frame_size;
+    size_t i;
+
+    for (i = 0; i < sizeof(container_overheads) / sizeof(container_overheads[0]); i++)
+    {
+        if (strcmp(container_overheads[i].name, output_format->name) == 0)
+        {
+            overhead = &container_overheads[i];
+            break;
+        }
+    }
+
+    duration = estimate_input_duration(input_format_context, src_size);
+    if (duration <= 0)
+    {
+        // Nothing is known about the input, guess a typical compression.
+        return FFMAX(src_size / 8, overhead->header + 4096);
+    }
+
+    frame_size = encoder->frame_size > 0 ? encoder->frame_size : 1024;
+    nb_frames  = duration * encoder->sample_rate / frame_size;
+
+    bytes = encoded_bit_rate(encoder) * duration / 8 + nb_frames * overhead->per_frame;
+
+    return (size_t)(bytes * ESTIMATE_MARGIN) + overhead->header;
+}
@@ -0,0 +1,398 @@
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "sample_ring.h"
+
+
+// What the buffer of a frame read from the ring gives back when it's freed
+typedef struct SlotRef {
+    SampleRing *ring;
+    int         nb_samples;
+} SlotRef;
+
+struct SampleRing {
+    int       nb_planes;
+    int       sample_size; // bytes of a sample in a plane, of all channels if interleaved
+    int       frame_size;  // samples of a slot
+
+    // Each plane is capacity samples of ring, then as many of overflow.
+    uint8_t  *samples;
+    int       linesize;    // bytes between the planes
+    int       capacity;    // a whole number of slots
+    SlotRef  *slots;       // one per slot, the opaque of the buffers of the frames read
+
+    // Owned by the user of the ring, see sample_ring.h
+    int       read_pos;
+    int       size;
+    int       reserved;    // samples reserved and not committed yet
+    int       held;        // whether the caller's frame isn't released yet
+
+    /*
+     Samples read and still referenced by frames, right before read_pos, and
+     whether the ring has been freed meanwhile. The last reference to a
+     frame may be dropped on any thread, e.g. by the encoder.
+     */
+    pthread_mutex_t lock;
+    int       pinned;
+    int       orphaned;
+
+    uint8_t **write_data;  // returned by sample_ring_reserve()
+    uint8_t **read_data;   // extended data of the frame read
+};
+
+
+// Address of the sample at pos in plane of samples.
+static uint8_t *sample_address(const SampleRing *ring, uint8_t *samples, int linesize,
+                               int plane, int pos)
+{
+    return samples + (size_t)plane * linesize + (size_t)pos * ring->sample_size;
+}
+
+static int pinned_samples(SampleRing *ring)
+{
+    int pinned;
+
+    pthread_mutex_lock(&ring->lock);
+    pinned = ring->pinned;
+    pthread_mutex_unlock(&ring->lock);
+
+    return pinned;
+}
+
+static void free_ring(SampleRing *ring)
+{
+    pthread_mutex_destroy(&ring->lock);
+    av_free(ring->samples);
+    av_free(ring->slots);
+    av_free(ring->write_data);
+    av_free(ring->read_data);
+    av_free(ring);
+}
+
+/*
+ Move the samples to a new ring of capacity samples, at its start and in
+ order, so that they don't wrap around any more. No frame read from the
+ ring may be referenced.
+ */
+static int realloc_samples(SampleRing *ring, int capacity)
+{
+    uint8_t *samples;
+    SlotRef *slots;
+    int linesize, plane, first;
+
+    if (capacity > (INT_MAX - 64) / 2 / ring->sample_size)
+    {
+        return AVERROR(EINVAL);
+    }
+    // Planes aligned for the SIMD of the encoders
+    linesize = FFALIGN(2 * capacity * ring->sample_size, 64);
+
+    samples = (uint8_t *)av_malloc((size_t)linesize * ring->nb_planes);
+    slots   = (SlotRef *)av_malloc_array(capacity / ring->frame_size, sizeof(SlotRef));
+    if (!samples || !slots)
+    {
+        av_free(samples);
+        av_free(slots);
+        return AVERROR(ENOMEM);
+    }
+
+    first = FFMIN(ring->size, ring->capacity - ring->read_pos);
+    for (plane = 0; ring->size > 0 && plane < ring->nb_planes; plane++)
+    {
+        memcpy(sample_address(ring, samples, linesize, plane, 0),
+               sample_address(ring, ring->samples, ring->linesize, plane, ring->read_pos),
+               (size_t)first * ring->sample_size);
+        memcpy(sample_address(ring, samples, linesize, plane, first),
+               sample_address(ring, ring->samples, ring->linesize, plane, 0),
+               (size_t)(ring->size - first) * ring->sample_size);
+    }
+
+    av_free(ring->samples);
+    av_free(ring->slots);
+    ring->samples  = samples;
+    ring->slots    = slots;
+    ring->linesize = linesize;
+    ring->capacity = capacity;
+    ring->read_pos = 0;
+
+    return 0;
+}
+
+/*
+ Free callback of the buffer of a frame read from the ring: its slot can be
+ written again, or the ring freed if it's been freed by its user already.
+ */
+static void release_slot(void *opaque, uint8_t *data)
+{
+    SlotRef *slot = (SlotRef *)opaque;
+    SampleRing *ring = slot->ring;
+    int orphaned;
+
+    (void)data;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->pinned -= slot->nb_samples;
+    orphaned = ring->orphaned && ring->pinned == 0;
+    pthread_mutex_unlock(&ring->lock);
+
+    if (orphaned)
+    {
+        free_ring(ring);
+    }
+}
+
+int sample_ring_alloc(SampleRing **ring, enum AVSampleFormat sample_fmt, int channels,
+                      int frame_size, int nb_samples)
+{
+    SampleRing *r;
+    int error;
+
+    if (channels <= 0 || frame_size <= 0 || av_get_bytes_per_sample(sample_fmt) <= 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    r = (SampleRing *)av_mallocz(sizeof(SampleRing));
+    if (!r)
+    {
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&r->lock, NULL);
+
+    r->nb_planes   = av_sample_fmt_is_planar(sample_fmt) ? channels : 1;
+    r->sample_size = av_get_bytes_per_sample(sample_fmt) * (r->nb_planes == 1 ? channels : 1);
+    r->frame_size  = frame_size;
+
+    r->write_data = (uint8_t **)av_malloc_array(r->nb_planes, sizeof(uint8_t *));
+    r->read_data  = (uint8_t **)av_malloc_array(r->nb_planes, sizeof(uint8_t *));
+    if (!r->write_data || !r->read_data)
+    {
+        sample_ring_free(&r);
+        return AVERROR(ENOMEM);
+    }
+
+    error = realloc_samples(r, (FFMAX(nb_samples, 1) + frame_size - 1) / frame_size * frame_size);
+    if (error < 0)
+    {
+        sample_ring_free(&r);
+        return error;
+    }
+
+    *ring = r;
+
+    return 0;
+}
+
+void sample_ring_free(SampleRing **ring)
+{
+    SampleRing *r = *ring;
+    int pinned;
+
+    if (!r)
+    {
+        return;
+    }
+    *ring = NULL;
+
+    // Frames still referenced, e.g. by an encoder, free the ring once they're gone.
+    pthread_mutex_lock(&r->lock);
+    pinned = r->pinned;
+    r->orphaned = 1;
+    pthread_mutex_unlock(&r->lock);
+
+    if (pinned == 0)
+    {
+        free_ring(r);
+    }
+}
+
+void sample_ring_reset(SampleRing *ring)
+{
+    // The samples of the frames still referenced stay where they are.
+    ring->size     = 0;
+    ring->reserved = 0;
+    ring->held     = 0;
+}
+
+int sample_ring_size(const SampleRing *ring)
+{
+    return ring->size;
+}
+
+int sample_ring_can_write(SampleRing *ring, int nb_samples)
+{
+    const int pinned = pinned_samples(ring);
+
+    return nb_samples <= ring->capacity - ring->size - pinned || pinned == 0;
+}
+
+int sample_ring_reserve(SampleRing *ring, int nb_samples, uint8_t ***data)
+{
+    const int pinned = pinned_samples(ring);
+    int write_pos, plane, error;
+
+    // Back to the first slot when the ring is empty.
+    if (ring->size == 0 && pinned == 0)
+    {
+        ring->read_pos = 0;
+    }
+
+    if (nb_samples > ring->capacity - ring->size - pinned)
+    {
+        // Frames read point into the current ring.
+        if (pinned)
+        {
+            return AVERROR(EAGAIN);
+        }
+        if (nb_samples > INT_MAX / 2 - ring->size)
+        {
+            return AVERROR(EINVAL);
+        }
+        error = realloc_samples(ring, FFMAX(2 * ring->capacity,
+                                            (ring->size + nb_samples + ring->frame_size - 1) /
+                                            ring->frame_size * ring->frame_size));
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+
+    // May run into the overflow area, which is as large as the ring.
+    write_pos = (ring->read_pos + ring->size) % ring->capacity;
+    for (plane = 0; plane < ring->nb_planes; plane++)
+    {
+        ring->write_data[plane] = sample_address(ring, ring->samples, ring->linesize, plane, write_pos);
+    }
+    ring->reserved = FFMAX(nb_samples, 0);
+    *data = ring->write_data;
+
+    return 0;
+}
+
+void sample_ring_commit(SampleRing *ring, int nb_samples)
+{
+    const int write_pos = (ring->read_pos + ring->size) % ring->capacity;
+    const int overflow  = write_pos + nb_samples - ring->capacity;
+    int plane;
+
+    // Move what was written past the end of the ring to its start.
+    for (plane = 0; overflow > 0 && plane < ring->nb_planes; plane++)
+    {
+        memcpy(sample_address(ring, ring->samples, ring->linesize, plane, 0),
+               sample_address(ring, ring->samples, ring->linesize, plane, ring->capacity),
+               (size_t)overflow * ring->sample_size);
+    }
+
+    ring->size    += nb_samples;
+    ring->reserved = 0;
+}
+
+int sample_ring_write(SampleRing *ring, uint8_t * const *data, int nb_samples)
+{
+    uint8_t **write_data;
+    int plane, error;
+
+    if (nb_samples <= 0)
+    {
+        return 0;
+    }
+
+    error = sample_ring_reserve(ring, nb_samples, &write_data);
+    if (error < 0)
+    {
+        return error;
+    }
+    for (plane = 0; plane < ring->nb_planes; plane++)
+    {
+        memcpy(write_data[plane], data[plane], (size_t)nb_samples * ring->sample_size);
+    }
+    sample_ring_commit(ring, nb_samples);
+
+    return 0;
+}
+
+int sample_ring_read_frame(SampleRing *ring, AVFrame *frame, int nb_samples)
+{
+    SlotRef *slot;
+    int plane, error;
+
+    if (nb_samples <= 0 || nb_samples > ring->size || ring->held)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    /*
+     Slots are read whole, so a frame only wraps around after a shorter one,
+     e.g. the last of an input: the samples are moved to the start then.
+     */
+    if (ring->read_pos + nb_samples > ring->capacity)
+    {
+        if (ring->reserved || pinned_samples(ring))
+        {
+            return AVERROR(EAGAIN);
+        }
+        error = realloc_samples(ring, ring->capacity);
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+
+    for (plane = 0; plane < ring->nb_planes; plane++)
+    {
+        ring->read_data[plane] = sample_address(ring, ring->samples, ring->linesize, plane,
+                                                ring->read_pos);
+    }
+
+    /*
+     The frame references its slot, so that the encoder can keep a reference
+     to it rather than a copy. The buffer spans the slot in every plane.
+     A shorter frame that empties the ring takes its whole slot, so that the
+     next frame starts at a slot of its own.
+     */
+    slot = &ring->slots[ring->read_pos / ring->frame_size];
+    slot->ring       = ring;
+    slot->nb_samples = nb_samples;
+    if (nb_samples == ring->size && !ring->reserved)
+    {
+        slot->nb_samples = ring->frame_size - ring->read_pos % ring->frame_size;
+    }
+    frame->buf[0] = av_buffer_create(ring->read_data[0],
+                                     (ring->nb_planes - 1) * ring->linesize + nb_samples * ring->sample_size,
+                                     release_slot, slot, 0);
+    if (!frame->buf[0])
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    memcpy(frame->data, ring->read_data,
+           FFMIN(ring->nb_planes, AV_NUM_DATA_POINTERS) * sizeof(uint8_t *));
+    frame->extended_data = ring->nb_planes > AV_NUM_DATA_POINTERS ? ring->read_data : frame->data;
+    frame->linesize[0]   = nb_samples * ring->sample_size;
+    frame->nb_samples    = nb_samples;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->pinned += slot->nb_samples;
+    pthread_mutex_unlock(&ring->lock);
+
+    ring->read_pos = (ring->read_pos + slot->nb_samples) % ring->capacity;
+    ring->size    -= nb_samples;
+    ring->held     = 1;
+
+    return 0;
+}
+
+void sample_ring_release_frame(SampleRing *ring, AVFrame *frame)
+{
+    ring->held = 0;
+
+    // The extended data belongs to the ring, keep av_frame_unref() from freeing it.
+    frame->extended_data = frame->data;
+    av_frame_unref(frame);
+}
@@ -0,0 +1,325 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavformat/avio.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "transcoding.h"
+#include "transcoding_internal.h"
+
+
+/*
+ The job runs on its own thread, reading the fed chunks through a read
+ callback that blocks until more input is fed or the input is finished.
+ */
+struct Transcoder {
+    TranscodingSession *session;
+    pthread_t           thread;
+    int                 thread_started;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+
+    // Input fed so far, kept whole so that the demuxer can seek back.
+    uint8_t            *in_buf;
+    size_t              in_size;
+    size_t              in_total;
+    size_t              in_pos;
+    int                 in_finished; // set once no more input is fed
+    int                 aborted;
+
+    // Output not drained yet.
+    uint8_t            *out_buf;
+    size_t              out_size;
+    size_t              out_total;
+    size_t              out_written; // all bytes written so far
+
+    int                 done;        // set once the job has ended
+    int                 status;
+    JobResult           result;
+};
+
+
+static int push_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    Transcoder *transcoder = (Transcoder *)opaque;
+    int size;
+
+    pthread_mutex_lock(&transcoder->lock);
+    while (transcoder->in_pos >= transcoder->in_size &&
+           !transcoder->in_finished && !transcoder->aborted)
+    {
+        pthread_cond_wait(&transcoder->cond, &transcoder->lock);
+    }
+
+    if (transcoder->aborted)
+    {
+        size = AVERROR_EXIT;
+    }
+    else if (transcoder->in_pos >= transcoder->in_size)
+    {
+        size = AVERROR_EOF;
+    }
+    else
+    {
+        size = (int)FFMIN((size_t)buf_size, transcoder->in_size - transcoder->in_pos);
+        memcpy(buf, transcoder->in_buf + transcoder->in_pos, size);
+        transcoder->in_pos += size;
+    }
+    pthread_mutex_unlock(&transcoder->lock);
+
+    return size;
+}
+
+// Seeks beyond the input fed so far wait until it's fed, or until the input is finished.
+static int64_t push_seek(void *opaque, int64_t offset, int whence)
+{
+    Transcoder *transcoder = (Transcoder *)opaque;
+    int64_t new_pos;
+
+    pthread_mutex_lock(&transcoder->lock);
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+        case SEEK_SET:
+            new_pos = offset;
+            break;
+        case SEEK_CUR:
+            new_pos = transcoder->in_pos + offset;
+            break;
+        case SEEK_END:
+        case AVSEEK_SIZE:
+            // The size is unknown before the input is finished.
+            if (!transcoder->in_finished)
+            {
+                pthread_mutex_unlock(&transcoder->lock);
+                return AVERROR(ENOSYS);
+            }
+            if ((whence & ~AVSEEK_FORCE) == AVSEEK_SIZE)
+            {
+                pthread_mutex_unlock(&transcoder->lock);
+                return transcoder->in_size;
+            }
+            new_pos = transcoder->in_size + offset;
+            break;
+        default:
+            pthread_mutex_unlock(&transcoder->lock);
+            return AVERROR(EINVAL);
+    }
+
+    while (new_pos > (int64_t)transcoder->in_size &&
+           !transcoder->in_finished && !transcoder->aborted)
+    {
+        pthread_cond_wait(&transcoder->cond, &transcoder->lock);
+    }
+
+    transcoder->in_pos = FFMIN(FFMAX(new_pos, 0), (int64_t)transcoder->in_size);
+    new_pos = transcoder->aborted ? AVERROR_EXIT : (int64_t)transcoder->in_pos;
+
+    pthread_mutex_unlock(&transcoder->lock);
+
+    return new_pos;
+}
+
+// Append data to a growing buffer, lock must be held.
+static int append_locked(uint8_t **buf, size_t *size, size_t *total, const uint8_t *data, size_t data_size)
+{
+    if (*size + data_size > *total)
+    {
+        size_t new_total = FFMAX(*total * 2, *size + data_size);
+        uint8_t *ptr = (uint8_t *)buffer_realloc(*buf, new_total);
+        if (ptr == NULL)
+        {
+            fprintf(stderr, "Could not alloc memory !");
+            return AVERROR(ENOMEM);
+        }
+        *buf   = ptr;
+        *total = new_total;
+    }
+
+    memcpy(*buf + *size, data, data_size);
+    *size += data_size;
+
+    return 0;
+}
+
+static int push_write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    Transcoder *transcoder = (Transcoder *)opaque;
+    int error;
+
+    pthread_mutex_lock(&transcoder->lock);
+    error = append_locked(&transcoder->out_buf, &transcoder->out_size, &transcoder->out_total,
+                          buf, buf_size);
+    if (error == 0)
+    {
+        transcoder->out_written += buf_size;
+    }
+    pthread_mutex_unlock(&transcoder->lock);
+
+    return error < 0 ? error : buf_size;
+}
+
+static void *transcoder_main(void *arg)
+{
+    Transcoder *transcoder = (Transcoder *)arg;
+    JobIO io;
+    int status;
+
+    memset(&io, 0, sizeof(JobIO));
+    io.read_opaque  = transcoder;
+    io.read_packet  = &push_read_packet;
+    io.read_seek    = &push_seek;
+    // The output is drained while it's written, so it can't be seeked back.
+    io.write_opaque = transcoder;
+    io.write_packet = &push_write_packet;
+
+    status = transcoding_session_run(transcoder->session, &io, &transcoder->result);
+
+    pthread_mutex_lock(&transcoder->lock);
+    transcoder->status = status;
+    transcoder->done   = 1;
+    pthread_cond_broadcast(&transcoder->cond);
+    pthread_mutex_unlock(&transcoder->lock);
+
+    return NULL;
+}
+
+int transcoder_create(Transcoder **p_transcoder, const TranscodingArgs args)
+{
+    Transcoder *transcoder;
+    int error;
+
+    if (needs_seekable_output(args.format_name))
+    {
+        fprintf(stderr, "Format %s needs a seekable output, which a transcoder doesn't have.\n",
+                args.format_name);
+        return AVERROR(EINVAL);
+    }
+
+    transcoder = (Transcoder *)av_mallocz(sizeof(Transcoder));
+    if (NULL == transcoder)
+    {
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&transcoder->lock, NULL);
+    pthread_cond_init(&transcoder->cond, NULL);
+
+    error = transcoding_session_create(&transcoder->session, args);
+    if (error < 0)
+    {
+        transcoder_destroy(&transcoder);
+        return error;
+    }
+
+    error = pthread_create(&transcoder->thread, NULL, &transcoder_main, transcoder);
+    if (error != 0)
+    {
+        fprintf(stderr, "Could not start transcoder thread.\n");
+        transcoder_destroy(&transcoder);
+        return AVERROR(error);
+    }
+    transcoder->thread_started = 1;
+
+    *p_transcoder = transcoder;
+
+    return 0;
+}
+
+int transcoder_feed(Transcoder *transcoder, const BufferData chunk)
+{
+    int error;
+
+    pthread_mutex_lock(&transcoder->lock);
+    if (transcoder->in_finished)
+    {
+        error = AVERROR(EINVAL);
+    }
+    else if (transcoder->done)
+    {
+        error = transcoder->status < 0 ? transcoder->status : AVERROR_EOF;
+    }
+    else
+    {
+        error = append_locked(&transcoder->in_buf, &transcoder->in_size, &transcoder->in_total,
+                              chunk.buf, chunk.size);
+        pthread_cond_broadcast(&transcoder->cond);
+    }
+    pthread_mutex_unlock(&transcoder->lock);
+
+    return error;
+}
+
+int transcoder_drain(Transcoder *transcoder, BufferData *out)
+{
+    int error;
+
+    pthread_mutex_lock(&transcoder->lock);
+    out->buf  = transcoder->out_buf;
+    out->size = transcoder->out_size;
+
+    transcoder->out_buf   = NULL;
+    transcoder->out_size  = 0;
+    transcoder->out_total = 0;
+
+    error = transcoder->done && transcoder->status < 0 ? transcoder->status : 0;
+    pthread_mutex_unlock(&transcoder->lock);
+
+    return error;
+}
+
+int transcoder_finish(Transcoder *transcoder, BufferData *out, int *out_bit_rate, float *out_duration)
+{
+    int error;
+
+    pthread_mutex_lock(&transcoder->lock);
+    transcoder->in_finished = 1;
+    pthread_cond_broadcast(&transcoder->cond);
+    pthread_mutex_unlock(&transcoder->lock);
+
+    if (transcoder->thread_started)
+    {
+        pthread_join(transcoder->thread, NULL);
+        transcoder->thread_started = 0;
+    }
+
+    error = transcoder_drain(transcoder, out);
+    if (error < 0)
+    {
+        transcoding_free_output(out);
+        return error;
+    }
+
+    get_job_output_info(transcoder->out_written, &transcoder->result, out_bit_rate, out_duration);
+
+    return 0;
+}
+
+void transcoder_destroy(Transcoder **p_transcoder)
+{
+    Transcoder *transcoder;
+
+    if (NULL == p_transcoder || NULL == *p_transcoder)
+    {
+        return;
+    }
+    transcoder = *p_transcoder;
+
+    if (transcoder->thread_started)
+    {
+        pthread_mutex_lock(&transcoder->lock);
+        transcoder->aborted = 1;
+        pthread_cond_broadcast(&transcoder->cond);
+        pthread_mutex_unlock(&transcoder->lock);
+
+        pthread_join(transcoder->thread, NULL);
+    }
+
+    transcoding_session_destroy(&transcoder->session);
+    pthread_mutex_destroy(&transcoder->lock);
+    pthread_cond_destroy(&transcoder->cond);
+    buffer_free(transcoder->in_buf);
+    buffer_free(transcoder->out_buf);
+    av_freep(p_transcoder);
+}
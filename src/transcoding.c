@@ -1,29 +1,436 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 
 #include <libavcodec/avcodec.h>
 
-#include <libavutil/audio_fifo.h>
+#include <libavutil/mathematics.h>
 #include <libavutil/avstring.h>
 #include <libavutil/frame.h>
 #include <libavutil/opt.h>
 
 #include <libswresample/swresample.h>
 
+#include "audio_header.h"
+#include "codec_pool.h"
+#include "output_estimate.h"
+#include "sample_ring.h"
 #include "transcoding.h"
+#include "transcoding_internal.h"
 
 
+// How the input is opened: its format, AVIO buffer and probing limits, from the args
+typedef struct InputOptions {
+    AVInputFormat      *format;      // NULL to probe it
+    int                 buffer_size; // 0 to size it after the input
+    int64_t             probesize;
+    int64_t             analyze_duration;
+} InputOptions;
+
+/*
+ Buffers of the encode path, reused by every frame and packet of the
+ session's encoder rather than allocated for each. The pool keeps the
+ buffers given back, so that a long input is encoded with a few of them.
+ Only the encoders that take their packets from the user (AV_CODEC_CAP_DR1,
+ libavcodec 58.134 and later) use it, it isn't allocated for the others.
+ */
+typedef struct EncodeBuffers {
+    AVFrame            *frame;       // output frame, its samples in the FIFO
+    AVBufferPool       *packet_pool; // encoded packets, NULL if the encoder allocates them
+    int                 packet_size; // bytes of the packet_pool buffers, padding excluded
+} EncodeBuffers;
+
+// Converted samples kept for the whole transcode
+typedef struct SampleBuffer {
+    uint8_t           **data;     // one pointer per plane, in the encoder's format
+    int                 capacity; // in samples
+} SampleBuffer;
+
+/*
+ The session keeps the encoder, resampler and FIFO configured for one
+ TranscodingArgs profile, so that consecutive inputs of the same shape
+ don't have to set them up again.
+ */
+struct TranscodingSession {
+    TranscodingArgs     args;
+    char                format_name[32]; // own copy of args.format_name
+    char                in_format_name[32]; // own copy of args.in_format_name
+    InputOptions        input_options;
+    AVOutputFormat     *output_format;
+    AVCodec            *output_codec;
+
+    EncoderKey          encoder_key;
+    AVCodecContext     *output_codec_context;
+    ResamplerKey        resampler_key;
+    SwrContext         *resample_context;
+    SampleRing         *fifo;
+
+    // Scratch storage of the decode and convert loop, reused by every packet
+    AVFrame            *input_frame;
+    SampleBuffer        converted; // only for fan-out stages, others convert into the FIFO
+    EncodeBuffers       encode_buffers;
+
+    // Input shape the contexts above have been configured for.
+    int                 in_sample_rate;
+    enum AVSampleFormat in_sample_fmt;
+    int                 in_channels;
+
+    // Set once a job has used the contexts, cleared by a reset.
+    int                 dirty;
+
+    // Statistics of the last successful job
+    TranscodingStats    stats;
+};
+
+
+/*
+ Codec and muxer lookups walk the registered lists, so the ones for the
+ most common formats are resolved once by transcoding_global_init().
+ The tables are read-only afterwards.
+ */
+typedef struct OutputFormatEntry {
+    const char     *name;
+    AVOutputFormat *format;
+    AVCodec        *encoder;
+} OutputFormatEntry;
+
+static OutputFormatEntry output_format_table[] = {
+    { "mp3",  NULL, NULL },
+    { "aac",  NULL, NULL },
+    { "m4a",  NULL, NULL },
+    { "mp4",  NULL, NULL },
+    { "ogg",  NULL, NULL },
+    { "opus", NULL, NULL },
+    { "flac", NULL, NULL },
+    { "wav",  NULL, NULL },
+};
+
+// Demuxers of the inputs whose header is parsed natively, named as in AudioHeader
+typedef struct InputFormatEntry {
+    const char    *name;
+    AVInputFormat *format;
+} InputFormatEntry;
+
+static InputFormatEntry input_format_table[] = {
+    { "mp3",  NULL },
+    { "aac",  NULL },
+    { "wav",  NULL },
+    { "flac", NULL },
+};
+
+static const enum AVCodecID decoder_table_ids[] = {
+    AV_CODEC_ID_MP3, AV_CODEC_ID_AAC, AV_CODEC_ID_FLAC, AV_CODEC_ID_VORBIS, AV_CODEC_ID_OPUS,
+    AV_CODEC_ID_PCM_S16LE, AV_CODEC_ID_PCM_S24LE, AV_CODEC_ID_PCM_F32LE,
+};
+
+static AVCodec *decoder_table[sizeof(decoder_table_ids) / sizeof(decoder_table_ids[0])];
+
+// Moves the ADTS headers of AAC to the extradata, for the containers with global headers
+static const AVBitStreamFilter *adtstoasc_filter;
+
+static pthread_once_t global_init_once = PTHREAD_ONCE_INIT;
+
+// Guess the output container format and its audio encoder from a format name, such as "mp3".
+static void guess_output_format(const char *format_name, AVOutputFormat **format, AVCodec **encoder)
+{
+    char outname[16] = "o.";
+    enum AVCodecID encoder_id = AV_CODEC_ID_NONE;
+
+    av_strlcpy(outname+2, format_name, 14);
+
+    *encoder = NULL;
+    *format = av_guess_format(NULL, outname, NULL);
+    if (*format)
+    {
+        encoder_id = av_guess_codec(*format, NULL, NULL, NULL, AVMEDIA_TYPE_AUDIO);
+        *encoder = avcodec_find_encoder(encoder_id);
+    }
+}
+
+static void global_init(void)
+{
+    size_t i;
+
+    // Registration is automatic from libavformat 58.9, and gone in 59.
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+    av_register_all();
+#endif
+
+    for (i = 0; i < sizeof(output_format_table) / sizeof(output_format_table[0]); i++)
+    {
+        guess_output_format(output_format_table[i].name,
+                            &output_format_table[i].format,
+                            &output_format_table[i].encoder);
+    }
+
+    for (i = 0; i < sizeof(input_format_table) / sizeof(input_format_table[0]); i++)
+    {
+        input_format_table[i].format = av_find_input_format(input_format_table[i].name);
+    }
+
+    for (i = 0; i < sizeof(decoder_table_ids) / sizeof(decoder_table_ids[0]); i++)
+    {
+        decoder_table[i] = avcodec_find_decoder(decoder_table_ids[i]);
+    }
+
+    adtstoasc_filter = av_bsf_get_by_name("aac_adtstoasc");
+}
+
+int transcoding_global_init(void)
+{
+    int error = pthread_once(&global_init_once, &global_init);
+
+    return error == 0 ? 0 : AVERROR(error);
+}
+
+// Same as guess_output_format(), served from the prebuilt table when possible.
+static void find_output_format(const char *format_name, AVOutputFormat **format, AVCodec **encoder)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(output_format_table) / sizeof(output_format_table[0]); i++)
+    {
+        if (strcmp(output_format_table[i].name, format_name) == 0)
+        {
+            *format  = output_format_table[i].format;
+            *encoder = output_format_table[i].encoder;
+            return;
+        }
+    }
+
+    guess_output_format(format_name, format, encoder);
+}
+
+// Same as av_find_input_format(), served from the prebuilt table when possible.
+static AVInputFormat *find_input_format(const char *format_name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(input_format_table) / sizeof(input_format_table[0]); i++)
+    {
+        if (strcmp(input_format_table[i].name, format_name) == 0)
+        {
+            return input_format_table[i].format;
+        }
+    }
+
+    return av_find_input_format(format_name);
+}
+
+// Same as avcodec_find_decoder(), served from the prebuilt table when possible.
+static AVCodec *find_decoder(enum AVCodecID codec_id)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(decoder_table_ids) / sizeof(decoder_table_ids[0]); i++)
+    {
+        if (decoder_table_ids[i] == codec_id)
+        {
+            return decoder_table[i];
+        }
+    }
+
+    return avcodec_find_decoder(codec_id);
+}
+
+// Bounds of the adaptive AVIO buffer sizes
+#define IO_BUFFER_SIZE_MIN 4096
+#define IO_BUFFER_SIZE_MAX (1024 * 1024)
+
+/*
+ AVIO buffer size for about expected bytes of I/O: a 16th of them in pages,
+ from 4 KB for tiny clips, up to 1 MB for big PCM.
+ */
+static int adaptive_buffer_size(size_t expected)
+{
+    size_t size = FFALIGN(expected / 16, IO_BUFFER_SIZE_MIN);
+
+    return (int)FFMAX(FFMIN(size, IO_BUFFER_SIZE_MAX), IO_BUFFER_SIZE_MIN);
+}
+
+// Close an input opened by open_input_stream(), with its I/O context.
+static void close_input_stream(const JobIO *io, AVFormatContext **input_format_context)
+{
+    AVIOContext *pb = (*input_format_context)->pb;
+
+    // The custom I/O context isn't closed by avformat_close_input().
+    avformat_close_input(input_format_context);
+    if (pb && NULL == io->read_packet)
+    {
+        buffer_free(pb->opaque);
+    }
+    free_io_context(&pb);
+}
+
+// Resolve how the input is opened from the args.
+static int init_input_options(const TranscodingArgs *args, InputOptions *options)
+{
+    memset(options, 0, sizeof(InputOptions));
+
+    if (args->in_format_name && args->in_format_name[0])
+    {
+        options->format = find_input_format(args->in_format_name);
+        if (NULL == options->format)
+        {
+            fprintf(stderr, "Could not find input format %s.\n", args->in_format_name);
+            return AVERROR(EINVAL);
+        }
+    }
+    options->buffer_size      = args->in_buffer_size;
+    options->probesize        = args->probesize;
+    options->analyze_duration = args->analyze_duration;
+
+    return 0;
+}
+
+/*
+ Whether the demuxer read from the header all the decoder needs, so that
+ avformat_find_stream_info(), which may decode several frames, is skipped.
+ AAC isn't trusted: HE-AAC may signal SBR or PS only in the audio frames,
+ doubling the sample rate or the channels the header tells.
+ */
+static int header_has_stream_info(AVFormatContext *input_format_context)
+{
+    AVCodecParameters *codecpar;
+
+    if (input_format_context->nb_streams != 1)
+    {
+        return 0;
+    }
+    codecpar = input_format_context->streams[0]->codecpar;
+
+    return codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
+           codecpar->codec_id != AV_CODEC_ID_NONE &&
+           codecpar->codec_id != AV_CODEC_ID_AAC &&
+           codecpar->sample_rate > 0 &&
+           codecpar->channels > 0;
+}
+
+/*
+ Parse the header of an in-memory input natively, from its first segment if
+ it is read from segments.
+ */
+static int parse_input_header(const JobIO *io, AudioHeader *header)
+{
+    if (io->read_packet || io->probe_format)
+    {
+        return AVERROR(ENOSYS);
+    }
+    if (io->src_segments)
+    {
+        return parse_audio_header(io->src_segments[0].buf, io->src_segments[0].size,
+                                  io->src_buf.size, header);
+    }
+
+    return parse_audio_header(io->src_buf.buf, io->src_buf.size, io->src_buf.size, header);
+}
+
+/*
+ Fill in what the demuxer didn't read from the header with what the native
+ parser did: the stream parameters, which spares avformat_find_stream_info()
+ for mp3, and the duration and bit rate, which the output size is estimated from.
+ */
+static void apply_input_header(AVFormatContext *input_format_context, const AudioHeader *header)
+{
+    AVCodecParameters *codecpar;
+
+    if (input_format_context->nb_streams != 1 ||
+        strcmp(input_format_context->iformat->name, header->format_name) != 0)
+    {
+        return;
+    }
+    codecpar = input_format_context->streams[0]->codecpar;
+
+    if (codecpar->codec_id != header->codec_id)
+    {
+        return;
+    }
+    if (codecpar->sample_rate <= 0)
+    {
+        codecpar->sample_rate = header->sample_rate;
+    }
+    if (codecpar->channels <= 0)
+    {
+        codecpar->channels = header->channels;
+    }
+    if (header->duration > 0 &&
+        (input_format_context->duration == AV_NOPTS_VALUE || input_format_context->duration <= 0))
+    {
+        input_format_context->duration = header->duration;
+    }
+    if (header->bit_rate > 0 && input_format_context->bit_rate <= 0)
+    {
+        input_format_context->bit_rate = header->bit_rate;
+    }
+}
+
+// Limit the probing of the input format and streams as asked.
+static void set_probe_options(AVFormatContext *input_format_context, const InputOptions *options)
+{
+    if (options->probesize > 0)
+    {
+        input_format_context->probesize        = options->probesize;
+        input_format_context->format_probesize = (int)FFMIN(options->probesize, INT_MAX);
+    }
+    if (options->analyze_duration > 0)
+    {
+        input_format_context->max_analyze_duration = options->analyze_duration;
+    }
+}
+
+/*
+ Open the input of pb again from its start, with its format probed. The
+ format context is allocated, and freed on failure, pb is left to the caller.
+ */
+static int open_input_probed(AVFormatContext **input_format_context, AVIOContext *pb,
+                             const InputOptions *options)
+{
+    int64_t pos;
+
+    pos = avio_seek(pb, 0, SEEK_SET);
+    if (pos < 0)
+    {
+        return (int)pos;
+    }
+
+    *input_format_context = avformat_alloc_context();
+    if (NULL == *input_format_context)
+    {
+        return AVERROR(ENOMEM);
+    }
+    (*input_format_context)->pb = pb;
+    set_probe_options(*input_format_context, options);
+
+    return avformat_open_input(input_format_context, NULL, NULL, NULL);
+}
+
 // Open input stream and the required decoder.
-static int open_input_stream(const BufferData src,
+static int open_input_stream(const JobIO *io,
+                             const InputOptions *options,
                              AVFormatContext **input_format_context,
-                             AVCodecContext **input_codec_context)
+                             AVCodecContext **input_codec_context,
+                             DecoderKey *decoder_key)
 {
     AVCodecContext *avctx;
     AVCodec *input_codec;
     AVCodecParameters *codecpar;
-    int error;
+    AVIOContext *pb;
+    AVInputFormat *input_format = options->format;
+    AudioHeader header;
+    BufferIO *bio = NULL;
+    int buffer_size = options->buffer_size;
+    int has_header, error;
+
+    // Known headers spare the probing, a format hint still wins.
+    has_header = parse_input_header(io, &header) == 0;
+    if (has_header && NULL == input_format)
+    {
+        input_format = find_input_format(header.format_name);
+    }
 
     *input_format_context = avformat_alloc_context();
 
@@ -33,35 +440,93 @@ static int open_input_stream(const BufferData src,
         return AVERROR(ENOMEM);
     }
 
-    BufferIO *bio = (BufferIO *)av_malloc(sizeof(BufferIO));
-    bio->buf = src.buf;
-    bio->curr = 0;
-    bio->size = src.size;
-    bio->_total = src.size;
+    if (io->read_packet)
+    {
+        error = init_io_context_custom(*input_format_context,
+                                       buffer_size > 0 ? buffer_size : IO_BUFFER_SIZE_MIN, 0,
+                                       io->read_opaque, io->read_packet, NULL, io->read_seek);
+    }
+    else
+    {
+        bio = (BufferIO *)buffer_alloc(sizeof(BufferIO));
+        if (bio == NULL)
+        {
+            error = AVERROR(ENOMEM);
+        }
+        else
+        {
+            bio->buf = io->src_buf.buf;
+            bio->curr = 0;
+            bio->size = io->src_buf.size;
+            bio->_total = io->src_buf.size;
+            bio->flags = BUFFER_IO_BORROWED | BUFFER_IO_FIXED;
+            bio->nb_calls = 0;
+            bio->nb_reallocs = 0;
+            bio->segments = io->src_segments;
+            bio->nb_segments = io->nb_src_segments;
+            bio->_segment = 0;
+            bio->_segment_start = 0;
+
+            if (buffer_size <= 0)
+            {
+                // No larger buffer than the input, rounded up to a page
+                buffer_size = (int)FFMIN(adaptive_buffer_size(io->src_buf.size),
+                                         FFALIGN(io->src_buf.size + 1, IO_BUFFER_SIZE_MIN));
+            }
 
-    error = init_io_context_default(*input_format_context, 0, bio);
+            if (io->read_copy)
+            {
+                error = init_io_context_sized(*input_format_context, buffer_size, 0, bio);
+            }
+            else
+            {
+                // The buffer is only a window for the demuxer's small reads.
+                error = init_io_context_direct(*input_format_context, buffer_size, bio);
+            }
+        }
+    }
     if (error != 0)
     {
         fprintf(stderr, "Could not init IO context.\n");
-        avformat_close_input(input_format_context);
+        buffer_free(bio);
+        avformat_free_context(*input_format_context);
         *input_format_context = NULL;
         return error;
     }
 
-    error = avformat_open_input(input_format_context, NULL, NULL, NULL);
+    set_probe_options(*input_format_context, options);
+
+    // The format context is freed on failure, but not the custom I/O context.
+    pb = (*input_format_context)->pb;
+    error = avformat_open_input(input_format_context, NULL, input_format, NULL);
+    if (error < 0 && input_format != options->format)
+    {
+        // The format of the parsed header was only a guess, probe it then.
+        error = open_input_probed(input_format_context, pb, options);
+    }
     if (error < 0)
     {
         fprintf(stderr, "Could not open input stream.\n");
+        buffer_free(bio);
+        free_io_context(&pb);
         *input_format_context = NULL;
         return error;
     }
 
-    error = avformat_find_stream_info(*input_format_context, NULL);
-    if (error < 0)
+    if (has_header)
     {
-        fprintf(stderr, "Could not open find stream info.\n");
-        avformat_close_input(input_format_context);
-        return error;
+        apply_input_header(*input_format_context, &header);
+    }
+
+    if (io->find_stream_info || !header_has_stream_info(*input_format_context))
+    {
+        error = avformat_find_stream_info(*input_format_context, NULL);
+        if (error < 0)
+        {
+            fprintf(stderr, "Could not open find stream info.\n");
+            close_input_stream(io, input_format_context);
+            return error;
+        }
     }
 
     // Make sure that there is only one stream in the input file.
@@ -70,54 +535,26 @@ static int open_input_stream(const BufferData src,
         fprintf(stderr,
                 "Expected one audio input stream, but found %d.\n",
                 (*input_format_context)->nb_streams);
-        avformat_close_input(input_format_context);
+        close_input_stream(io, input_format_context);
         return AVERROR_EXIT;
     }
 
     codecpar = (*input_format_context)->streams[0]->codecpar;
 
     // Find a decoder for the audio stream.
-    input_codec = avcodec_find_decoder(codecpar->codec_id);
+    input_codec = find_decoder(codecpar->codec_id);
     if (!input_codec)
     {
         fprintf(stderr, "Could not find input codec.\n");
-        avformat_close_input(input_format_context);
+        close_input_stream(io, input_format_context);
         return AVERROR_EXIT;
     }
 
-    // allocate a new decoding context
-    avctx = avcodec_alloc_context3(input_codec);
-    if (!avctx)
-    {
-        fprintf(stderr, "Could not allocate a decoding context.\n");
-        avformat_close_input(input_format_context);
-        return AVERROR(ENOMEM);
-    }
-
-    // initialize the stream parameters with demuxer information
-    error = avcodec_parameters_to_context(avctx, codecpar);
-    if (error < 0)
-    {
-        avformat_close_input(input_format_context);
-        avcodec_free_context(&avctx);
-        return error;
-    }
-
-    /*
-     Some of audio formats, such as *.wav whose codec is pcm_s16le,
-     have no infomation on channel layout, we need to set it manually in case aborting.
-    */
-    if (avctx->channel_layout == 0)
-    {
-        avctx->channel_layout = av_get_default_channel_layout(codecpar->channels);
-    }
-
-    error = avcodec_open2(avctx, input_codec, NULL);
+    // Check out a decoder opened with the stream parameters.
+    error = decoder_pool_acquire(codecpar, input_codec, decoder_key, &avctx);
     if (error < 0)
     {
-        fprintf(stderr, "Could not open input codec.\n");
-        avcodec_free_context(&avctx);
-        avformat_close_input(input_format_context);
+        close_input_stream(io, input_format_context);
         return error;
     }
 
@@ -127,7 +564,7 @@ static int open_input_stream(const BufferData src,
 }
 
 static int set_encoder_params(const TranscodingArgs args,
-                              AVCodecContext *encoder_ctx,
+                              EncoderKey *encoder_params,
                               AVCodec *encoder,
                               AVCodecContext *input_ctx)
 {
@@ -137,9 +574,10 @@ static int set_encoder_params(const TranscodingArgs args,
     // // Allow the use of the experimental encoders, such as AAC
     // encoder_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
-    encoder_ctx->channels = input_ctx->channels;
-    encoder_ctx->channel_layout = av_get_default_channel_layout(encoder_ctx->channels);
-    encoder_ctx->sample_fmt = input_ctx->sample_fmt;
+    encoder_params->codec_id = encoder->id;
+    encoder_params->channels = input_ctx->channels;
+    encoder_params->channel_layout = av_get_default_channel_layout(encoder_params->channels);
+    encoder_params->sample_fmt = input_ctx->sample_fmt;
 
     if (encoder->channel_layouts != NULL)
     {
@@ -147,7 +585,7 @@ static int set_encoder_params(const TranscodingArgs args,
         found = 0;
         while (encoder->channel_layouts[idx] != 0)
         {
-            if (encoder->channel_layouts[idx] == encoder_ctx->channel_layout)
+            if (encoder->channel_layouts[idx] == encoder_params->channel_layout)
             {
                 found = 1;
                 break;
@@ -158,8 +596,8 @@ static int set_encoder_params(const TranscodingArgs args,
         {
             char ch_layout_str[128];
             av_get_channel_layout_string(ch_layout_str, 128,
-                                         encoder_ctx->channels,
-                                         encoder_ctx->channel_layout);
+                                         encoder_params->channels,
+                                         encoder_params->channel_layout);
             fprintf(stderr, "channel layout is not supported : %s", ch_layout_str);
             return -1;
         }
@@ -180,7 +618,7 @@ static int set_encoder_params(const TranscodingArgs args,
         }
         if (found == 0)
         {
-            encoder_ctx->sample_fmt = encoder->sample_fmts[0];
+            encoder_params->sample_fmt = encoder->sample_fmts[0];
         }
     }
     else
@@ -208,11 +646,11 @@ static int set_encoder_params(const TranscodingArgs args,
         }
         if (found == 1)
         {
-            encoder_ctx->sample_rate = sample_rate;
+            encoder_params->sample_rate = sample_rate;
         }
         else
         {
-            encoder_ctx->sample_rate = encoder->supported_samplerates[0];
+            encoder_params->sample_rate = encoder->supported_samplerates[0];
             if (args.sample_rate > 0)
             {
                 fprintf(stdout,
@@ -224,63 +662,122 @@ static int set_encoder_params(const TranscodingArgs args,
     }
     else
     {
-        encoder_ctx->sample_rate = sample_rate;
+        encoder_params->sample_rate = sample_rate;
     }
 
     // For opus, it's encouraged to always use 48kHz
     if (encoder->id == AV_CODEC_ID_OPUS)
     {
-        encoder_ctx->sample_rate = 48000;
+        encoder_params->sample_rate = 48000;
     }
 
     if (args.bit_rate > 0)
     {
-        encoder_ctx->bit_rate = args.bit_rate;
+        encoder_params->bit_rate = args.bit_rate;
     }
 
     return 0;
 }
 
-// Open an output stream and the required encoder. Also set some basic encoder parameters.
-static int open_output_stream(const TranscodingArgs args, BufferIO * bio,
-                              AVCodecContext *input_codec_context,
-                              AVFormatContext **output_format_context,
-                              AVCodecContext **output_codec_context)
+// Check out an encoder for the session's target format, configured for the given input.
+static int open_encoder(TranscodingSession *session, AVCodecContext *input_codec_context)
 {
     int error;
-    AVStream *stream      = NULL;
-    AVCodecContext *avctx = NULL;
-    AVCodec *output_codec = NULL;
-    enum AVCodecID encoder_id = AV_CODEC_ID_NONE;
+    EncoderKey *key = &session->encoder_key;
 
-    // Create a new format context for the output container format.
-    char outname[16] = "o.";
-    av_strlcpy(outname+2, args.format_name, 14);
+    memset(key, 0, sizeof(EncoderKey));
+
+    error = set_encoder_params(session->args, key, session->output_codec, input_codec_context);
+    if (error != 0)
+    {
+        return error < 0 ? error : AVERROR_EXIT;
+    }
+
+    /*
+     Some container formats (like MP4) require global headers to be present
+     Mark the encoder so that it behaves accordingly.
+    */
+    if (session->output_format->flags & AVFMT_GLOBALHEADER)
+    {
+        key->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    return encoder_pool_acquire(key, session->output_codec, &session->output_codec_context);
+}
+
+// Free an output opened by open_output_stream(), with its I/O context.
+static void close_output_stream(AVFormatContext **output_format_context)
+{
+    AVIOContext *pb = (*output_format_context)->pb;
+
+    avformat_free_context(*output_format_context);
+    *output_format_context = NULL;
+    free_io_context(&pb);
+}
+
+// Free an output buffer and its data, unless the data is the caller's.
+static void free_output_buffer(BufferIO **p_bio)
+{
+    if (*p_bio)
+    {
+        if (!((*p_bio)->flags & BUFFER_IO_BORROWED))
+        {
+            buffer_free((*p_bio)->buf);
+        }
+        buffer_free(*p_bio);
+        *p_bio = NULL;
+    }
+}
+
+/*
+ Open an output stream for the session's container format, fed by the session's encoder,
+ or by the packets of copy_stream if it's set.
+ It's written to bio, unless io has a write callback.
+ */
+static int open_output_stream(TranscodingSession *session, const JobIO *io, BufferIO *bio,
+                              const AVStream *copy_stream,
+                              AVFormatContext **output_format_context)
+{
+    int error;
+    AVStream *stream = NULL;
+    AVCodecContext *avctx = session->output_codec_context;
 
-    error = avformat_alloc_output_context2(output_format_context, NULL, NULL, outname);
+    // Create a new format context for the output container format.
+    error = avformat_alloc_output_context2(output_format_context, session->output_format, NULL, NULL);
     if (error < 0)
     {
         fprintf(stderr, "Could not allocate output format context.\n");
         return error;
     }
 
-    error = init_io_context_default(*output_format_context, 1, bio);
-    if (error != 0 )
+    if (io && io->write_packet)
     {
-        fprintf(stderr, "Could not init output format context.\n");
-        avformat_free_context(*output_format_context);
-        *output_format_context = NULL;
-        return error;
+        // Streamed outputs keep small writes for a low latency.
+        int buffer_size = io->write_buffer_size > 0 ? io->write_buffer_size :
+                          session->args.out_buffer_size > 0 ? session->args.out_buffer_size :
+                          IO_BUFFER_SIZE_MIN;
+
+        error = init_io_context_custom(*output_format_context, buffer_size, 1, io->write_opaque,
+                                       NULL, io->write_packet, io->write_seek);
+    }
+    else if (io && io->dst_chunks && NULL == bio)
+    {
+        int buffer_size = session->args.out_buffer_size > 0 ? session->args.out_buffer_size :
+                          BUFFER_CHUNK_SIZE / 4;
+
+        error = init_io_context_chunked(*output_format_context, buffer_size, io->dst_chunks);
     }
+    else
+    {
+        // The buffer is sized after the expected output.
+        int buffer_size = session->args.out_buffer_size > 0 ? session->args.out_buffer_size :
+                          adaptive_buffer_size(bio->_total);
 
-    // Find the encoder to be used by its name.
-    // av_get_pcm_codec(enum AVSampleFormat fmt, int be)
-    encoder_id = av_guess_codec((*output_format_context)->oformat,
-                                NULL, NULL, NULL, AVMEDIA_TYPE_AUDIO);
-    output_codec = avcodec_find_encoder(encoder_id);
-    if (!output_codec)
+        error = init_io_context_sized(*output_format_context, buffer_size, 1, bio);
+    }
+    if (error != 0 )
     {
-        fprintf(stderr, "Could not find encoder.\n");
+        fprintf(stderr, "Could not init output format context.\n");
         goto cleanup;
     }
 
@@ -293,63 +790,47 @@ static int open_output_stream(const TranscodingArgs args, BufferIO * bio,
         goto cleanup;
     }
 
-    avctx = avcodec_alloc_context3(output_codec);
-    if (!avctx)
+    if (copy_stream)
     {
-        fprintf(stderr, "Could not allocate an encoding context.\n");
-        error = AVERROR(ENOMEM);
-        goto cleanup;
+        stream->time_base = copy_stream->time_base;
+
+        error = avcodec_parameters_copy(stream->codecpar, copy_stream->codecpar);
+        // The input container's tag may not be valid in the output one.
+        stream->codecpar->codec_tag = 0;
     }
+    else
+    {
+        // Set the sample rate for the container.
+        stream->time_base.num = 1;
+        stream->time_base.den = avctx->sample_rate;
 
-    error = set_encoder_params(args, avctx, output_codec, input_codec_context);
-    if (error != 0)
+        error = avcodec_parameters_from_context(stream->codecpar, avctx);
+    }
+    if (error < 0)
     {
+        fprintf(stderr, "Could not initialize stream parameters.\n");
         goto cleanup;
     }
 
-    // Set the sample rate for the container.
-    stream->time_base.num = 1;
-    stream->time_base.den = avctx->sample_rate;
-
-    /*
-     Some container formats (like MP4) require global headers to be present
-     Mark the encoder so that it behaves accordingly.
-    */
-    if ((*output_format_context)->oformat->flags & AVFMT_GLOBALHEADER)
-    {
-        avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    }
-
-    // Open the encoder for the audio stream to use it later.
-    error = avcodec_open2(avctx, output_codec, NULL);
-    if (error < 0)
-    {
-        fprintf(stderr, "Could not open output codec.\n");
-        goto cleanup;
-    }
-
-    error = avcodec_parameters_from_context(stream->codecpar, avctx);
-    if (error < 0)
-    {
-        fprintf(stderr, "Could not initialize stream parameters.\n");
-        goto cleanup;
-    }
-
-    *output_codec_context = avctx;
-
-    return 0;
+    return 0;
 
 cleanup:
-    avcodec_free_context(&avctx);
-    avformat_free_context(*output_format_context);
-    *output_format_context = NULL;
+    close_output_stream(output_format_context);
     return error < 0 ? error : AVERROR_EXIT;
 }
 
 // Initialize one data packet for reading or writing.
 static void init_packet(AVPacket *packet)
 {
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59, 0, 100)
     av_init_packet(packet);
+#else
+    // av_init_packet() is deprecated from libavcodec 59, the same defaults.
+    memset(packet, 0, sizeof(*packet));
+    packet->pts = AV_NOPTS_VALUE;
+    packet->dts = AV_NOPTS_VALUE;
+    packet->pos = -1;
+#endif
     // Set the packet data and size so that it is recognized as being empty.
     packet->data = NULL;
     packet->size = 0;
@@ -373,59 +854,69 @@ static int init_input_frame(AVFrame **frame)
  */
 static int init_resampler(AVCodecContext *input_codec_context,
                           AVCodecContext *output_codec_context,
+                          ResamplerKey *resampler_key,
                           SwrContext **resample_context)
 {
-    int error;
-
     /*
-     Create a resampler context for the conversion.
-     Set the conversion parameters.
+     Check out a resampler context for the conversion parameters.
      Default channel layouts based on the number of channels
      are assumed for simplicity (they are sometimes not detected
      properly by the demuxer and/or decoder).
      */
+    memset(resampler_key, 0, sizeof(ResamplerKey));
 
-    *resample_context = swr_alloc();
+    resampler_key->in_sample_rate     = input_codec_context->sample_rate;
+    resampler_key->in_sample_fmt      = input_codec_context->sample_fmt;
+    resampler_key->in_channel_layout  = av_get_default_channel_layout(input_codec_context->channels);
 
-    if (!(*resample_context))
-    {
-        fprintf(stderr, "Could not allocate resample context.\n");
-        return AVERROR(ENOMEM);
-    }
+    resampler_key->out_sample_rate    = output_codec_context->sample_rate;
+    resampler_key->out_sample_fmt     = output_codec_context->sample_fmt;
+    resampler_key->out_channel_layout = output_codec_context->channel_layout;
 
+    return resampler_pool_acquire(resampler_key, resample_context);
+}
 
-    av_opt_set_int(*resample_context, "in_sample_rate", input_codec_context->sample_rate, 0);
-    av_opt_set_sample_fmt(*resample_context, "in_sample_fmt", input_codec_context->sample_fmt, 0);
-    av_opt_set_channel_layout(*resample_context, "in_channel_layout",
-                              av_get_default_channel_layout(input_codec_context->channels), 0);
+/*
+ Whether the decoded samples have to be converted for the encoder, i.e. it
+ doesn't take their sample format, rate and channel layout as they are.
+ */
+static int needs_resampler(AVCodecContext *input_codec_context,
+                           AVCodecContext *output_codec_context)
+{
+    return input_codec_context->sample_rate != output_codec_context->sample_rate ||
+           input_codec_context->sample_fmt  != output_codec_context->sample_fmt  ||
+           input_codec_context->channels    != output_codec_context->channels    ||
+           av_get_default_channel_layout(input_codec_context->channels) !=
+           (int64_t)output_codec_context->channel_layout;
+}
 
-    av_opt_set_int(*resample_context, "out_sample_rate", output_codec_context->sample_rate, 0);
-    av_opt_set_sample_fmt(*resample_context, "out_sample_fmt", output_codec_context->sample_fmt, 0);
-    av_opt_set_channel_layout(*resample_context, "out_channel_layout",
-                              output_codec_context->channel_layout, 0);
+// Samples the FIFO is allocated for at first
+#define FIFO_INITIAL_SIZE 4096
 
-    // Open the resampler with the specified parameters.
-    error = swr_init(*resample_context);
-    if (error < 0)
-    {
-        fprintf(stderr, "Could not open resample context.\n");
-        swr_free(resample_context);
-        return error;
-    }
-    return 0;
+// Samples of an encoder frame, of the FIFO's slots
+static int encoder_frame_size(AVCodecContext *output_codec_context)
+{
+    return output_codec_context->frame_size > 0 ? output_codec_context->frame_size : FIFO_INITIAL_SIZE;
 }
 
 // Initialize a FIFO buffer for the audio samples to be encoded.
-static int init_fifo(AVAudioFifo **fifo, AVCodecContext *output_codec_context)
+static int init_fifo(SampleRing **fifo, AVCodecContext *output_codec_context)
 {
-    // Create the FIFO buffer based on the specified output sample format.
-    *fifo = av_audio_fifo_alloc(output_codec_context->sample_fmt,
-                                output_codec_context->channels, 1);
+    int error;
 
-    if (!fifo)
+    /*
+     Create the FIFO buffer based on the specified output sample format,
+     in slots of an encoder frame, with room for an encoder frame and a
+     decoded frame from the start.
+     */
+    error = sample_ring_alloc(fifo, output_codec_context->sample_fmt,
+                              output_codec_context->channels,
+                              encoder_frame_size(output_codec_context),
+                              FFMAX(2 * output_codec_context->frame_size, FIFO_INITIAL_SIZE));
+    if (error < 0)
     {
         fprintf(stderr, "Could not allocate FIFO.\n");
-        return AVERROR(ENOMEM);
+        return error;
     }
     return 0;
 }
@@ -443,7 +934,13 @@ static int write_output_file_header(AVFormatContext *output_format_context)
     return 0;
 }
 
-// Decode one audio frame from the input file.
+/*
+ Decode one audio frame from the input file. Packets are read and sent to
+ the decoder only when it needs more of them, since one packet may hold
+ several frames, and a frame-threaded decoder takes a few packets before
+ the first frame. At the end of the file, the decoder is drained.
+ finished is set once it's been drained, with no frame in data_present.
+ */
 static int decode_audio_frame(AVFrame *frame,
                               AVFormatContext *input_format_context,
                               AVCodecContext *input_codec_context,
@@ -452,71 +949,93 @@ static int decode_audio_frame(AVFrame *frame,
     int error;
     AVPacket input_packet; // Packet used for temporary storage.
 
-    init_packet(&input_packet);
+    *data_present = 0;
 
-    // Read one audio frame from the input file into a temporary packet.
-    error = av_read_frame(input_format_context, &input_packet);
-    if (error < 0)
+    while (1)
     {
-        // If we are at the end of the file, flush the decoder below.
+        // Take the next frame the decoder has ready.
+        error = avcodec_receive_frame(input_codec_context, frame);
+        if (error >= 0)
+        {
+            *data_present = 1;
+            return 0;
+        }
         if (error == AVERROR_EOF)
         {
             *finished = 1;
+            return 0;
         }
-        else
+        if (error != AVERROR(EAGAIN))
+        {
+            fprintf(stderr, "Could not decode frame.\n");
+            return error;
+        }
+
+        // Read one audio packet from the input file into a temporary packet.
+        init_packet(&input_packet);
+        error = av_read_frame(input_format_context, &input_packet);
+        if (error == AVERROR_EOF)
+        {
+            // At the end of the file, an empty packet drains the decoder.
+            error = avcodec_send_packet(input_codec_context, NULL);
+        }
+        else if (error < 0)
         {
             fprintf(stderr, "Could not read frame.\n");
             return error;
         }
-    }
+        else
+        {
+            error = avcodec_send_packet(input_codec_context, &input_packet);
+            av_packet_unref(&input_packet);
+        }
 
-    /*
-     Decode the audio frame stored in the temporary packet.
-     The input audio stream decoder is used to do this.
-     If we are at the end of the file, pass an empty packet to the decoder
-     to flush it.
-     */
-    error = avcodec_decode_audio4(input_codec_context, frame, data_present, &input_packet);
-    if (error < 0)
-    {
-        fprintf(stderr, "Could not decode frame.\n");
-        av_packet_unref(&input_packet);
-        return error;
+        if (error < 0)
+        {
+            fprintf(stderr, "Could not send packet for decoding.\n");
+            return error;
+        }
     }
+}
 
-    /*
-     If the decoder has not been flushed completely, we are not finished,
-     so that this function has to be called again.
-     */
-    if (*finished && *data_present)
+// Free the storage of the converted samples.
+static void free_sample_buffer(SampleBuffer *buffer)
+{
+    if (buffer->data)
     {
-        *finished = 0;
+        buffer_free(buffer->data[0]);
+        buffer_free(buffer->data);
+        buffer->data = NULL;
     }
-
-    av_packet_unref(&input_packet);
-
-    return 0;
+    buffer->capacity = 0;
 }
 
 /*
- Initialize a temporary storage for the specified number of audio samples.
- The conversion requires temporary storage due to the different format.
- The number of audio samples to be allocated is specified in frame_size.
+ Make the storage of the converted samples hold at least nb_samples in the
+ encoder's format. It's only grown, by doubling, so that the conversion
+ stops allocating once it's large enough.
  */
-static int init_converted_samples(uint8_t ***converted_input_samples,
-                                  AVCodecContext *output_codec_context,
-                                  int frame_size)
+static int grow_sample_buffer(SampleBuffer *buffer,
+                              AVCodecContext *output_codec_context,
+                              int nb_samples)
 {
-    int error;
+    uint8_t **data = NULL;
+    uint8_t *samples = NULL;
+    int capacity, error;
+
+    if (nb_samples <= buffer->capacity)
+    {
+        return 0;
+    }
+    capacity = FFMAX(nb_samples, 2 * buffer->capacity);
 
     /*
      Allocate as many pointers as there are audio channels.
      Each pointer will later point to the audio samples of the corresponding
      channels (although it may be NULL for interleaved formats).
      */
-    *converted_input_samples = calloc(output_codec_context->channels,
-                                      sizeof(**converted_input_samples));
-    if (!(*converted_input_samples))
+    data = buffer_alloc(output_codec_context->channels * sizeof(*data));
+    if (!data)
     {
         fprintf(stderr, "Could not allocate converted input sample pointers.\n");
         return AVERROR(ENOMEM);
@@ -526,82 +1045,144 @@ static int init_converted_samples(uint8_t ***converted_input_samples,
      Allocate memory for the samples of all channels in one consecutive
      block for convenience.
      */
-    error = av_samples_alloc(*converted_input_samples, NULL,
-                             output_codec_context->channels, frame_size,
-                             output_codec_context->sample_fmt, 0);
+    error = av_samples_get_buffer_size(NULL, output_codec_context->channels, capacity,
+                                       output_codec_context->sample_fmt, 0);
+    if (error >= 0)
+    {
+        samples = (uint8_t *)buffer_alloc(error);
+        error = samples ? av_samples_fill_arrays(data, NULL, samples,
+                                                 output_codec_context->channels, capacity,
+                                                 output_codec_context->sample_fmt, 0)
+                        : AVERROR(ENOMEM);
+    }
     if (error < 0)
     {
         fprintf(stderr, "Could not allocate converted input samples.\n");
-        av_freep(&(*converted_input_samples)[0]);
-        free(*converted_input_samples);
+        buffer_free(samples);
+        buffer_free(data);
 
         return error;
     }
-    else
-    {
-        return 0;
-    }
 
+    free_sample_buffer(buffer);
+    buffer->data     = data;
+    buffer->capacity = capacity;
+
+    return 0;
 }
 
 // Add converted input audio samples to the FIFO buffer for later processing.
-static int add_samples_to_fifo(AVAudioFifo *fifo,
+static int add_samples_to_fifo(SampleRing *fifo,
                                uint8_t **converted_input_samples,
                                const int frame_size)
 {
-    int error;
-
     /*
-     Make the FIFO as large as it needs to be to hold both,
-     the old and the new samples.
+     Store the new samples in the FIFO buffer. It's doubled rather than grown
+     by each frame when it's full, and kept by the session, so that it soon
+     stops growing.
      */
-    if (frame_size <= 0)
+    if (sample_ring_write(fifo, converted_input_samples, frame_size) < 0)
+    {
+        fprintf(stderr, "Could not write data to FIFO.\n");
+        return AVERROR_EXIT;
+    }
+    else
     {
         return 0;
     }
-    error = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + frame_size);
-    if (error < 0)
+}
+
+// Most samples the resampler outputs for the decoded frame, with the ones it delays.
+static int max_converted_samples(AVFrame *input_frame,
+                                 AVCodecContext *input_codec_context,
+                                 AVCodecContext *output_codec_context,
+                                 SwrContext *resample_context)
+{
+    int64_t delay = swr_get_delay(resample_context, input_codec_context->sample_rate);
+
+    return (int)av_rescale_rnd(delay + input_frame->nb_samples,
+                               output_codec_context->sample_rate,
+                               input_codec_context->sample_rate,
+                               AV_ROUND_UP);
+}
+
+/*
+ Convert the samples of one decoded frame to the output sample format using
+ the resampler, into converted_samples, which has room for max_samples.
+ */
+static int convert_samples(AVFrame *input_frame,
+                           SwrContext *resample_context,
+                           uint8_t **converted_samples, int max_samples,
+                           int *converted_nb_samples)
+{
+    /*
+     Convert the input samples to the output sample format using the resampler.
+     */
+    *converted_nb_samples = swr_convert(resample_context,
+                                        converted_samples, max_samples,
+                                        (const uint8_t**)input_frame->extended_data,
+                                        input_frame->nb_samples);
+
+    if (*converted_nb_samples < 0)
     {
-        fprintf(stderr, "Could not reallocate FIFO.\n");
-        return error;
+        fprintf(stderr, "Could not convert input samples.\n");
+        return AVERROR_EXIT;
     }
 
-    // Store the new samples in the FIFO buffer.
-    if (av_audio_fifo_write(fifo, (void **)converted_input_samples, frame_size) < frame_size)
+    return 0;
+}
+
+/*
+ Convert the samples of one decoded frame into the FIFO buffer, where the
+ resampler writes them in place.
+ */
+static int convert_samples_into_fifo(AVFrame *input_frame,
+                                     AVCodecContext *input_codec_context,
+                                     AVCodecContext *output_codec_context,
+                                     SwrContext *resample_context,
+                                     SampleRing *fifo)
+{
+    uint8_t **converted_samples;
+    int max_samples, converted_nb_samples;
+
+    max_samples = max_converted_samples(input_frame, input_codec_context, output_codec_context,
+                                        resample_context);
+
+    // Make room for the converted input samples after the ones stored.
+    if (sample_ring_reserve(fifo, max_samples, &converted_samples) < 0)
     {
-        fprintf(stderr, "Could not write data to FIFO.\n");
+        fprintf(stderr, "Could not reserve FIFO space.\n");
         return AVERROR_EXIT;
     }
-    else
+
+    if (convert_samples(input_frame, resample_context, converted_samples, max_samples,
+                        &converted_nb_samples))
     {
-        return 0;
+        sample_ring_commit(fifo, 0);
+        return AVERROR_EXIT;
     }
+
+    sample_ring_commit(fifo, converted_nb_samples);
+
+    return 0;
 }
 
 /*
  Read one audio frame from the input file, decodes, converts and stores
  it in the FIFO buffer.
+ The frame is scratch storage kept by the caller, unreferenced before returning.
  */
-static int read_decode_convert_and_store(AVAudioFifo *fifo,
+static int read_decode_convert_and_store(SampleRing *fifo,
+                                         AVFrame *input_frame,
                                          AVFormatContext *input_format_context,
                                          AVCodecContext *input_codec_context,
                                          AVCodecContext *output_codec_context,
                                          SwrContext *resample_context,
                                          int *finished)
 {
-    // Temporary storage of the input samples of the frame read from the file.
-    AVFrame *input_frame = NULL;
-    // Temporary storage for the converted input samples.
-    uint8_t **converted_input_samples = NULL;
     int data_present;
     int ret = AVERROR_EXIT;
 
-    // Initialize temporary storage for one input frame.
-    if (init_input_frame(&input_frame))
-    {
-        goto cleanup;
-    }
-
     // Decode one frame worth of audio samples.
     if (decode_audio_frame(input_frame, input_format_context, input_codec_context,
                            &data_present, finished))
@@ -620,43 +1201,21 @@ static int read_decode_convert_and_store(AVAudioFifo *fifo,
         goto cleanup;
     }
 
-    // If there is decoded data, convert and store it
-    if (data_present)
+    // The encoder takes the decoded samples as they are.
+    if (data_present && NULL == resample_context)
     {
-        int64_t delay;
-        int desired_nb_samples, converted_nb_samples;
-        delay = swr_get_delay(resample_context, input_codec_context->sample_rate);
-
-        desired_nb_samples = (int)av_rescale_rnd(delay + input_frame->nb_samples,
-                                                 output_codec_context->sample_rate,
-                                                 input_codec_context->sample_rate,
-                                                 AV_ROUND_UP);
-
-        // Initialize the temporary storage for the converted input samples.
-        if (init_converted_samples(&converted_input_samples,
-                                   output_codec_context,
-                                   desired_nb_samples))
-        {
-            goto cleanup;
-        }
-
-        /*
-         Convert the input samples to the output sample format using the resampler.
-         This requires a temporary storage provided by converted_input_samples.
-         */
-        converted_nb_samples = swr_convert(resample_context,
-                                           converted_input_samples, desired_nb_samples,
-                                           (const uint8_t**)input_frame->extended_data,
-                                           input_frame->nb_samples);
-
-        if (converted_nb_samples < 0)
+        if (add_samples_to_fifo(fifo, input_frame->extended_data, input_frame->nb_samples))
         {
-            fprintf(stderr, "Could not convert input samples.\n");
             goto cleanup;
         }
 
-        // Add the converted samples to the FIFO buffer for later processing.
-        if (add_samples_to_fifo(fifo, converted_input_samples, converted_nb_samples))
+        ret = 0;
+    }
+    // If there is decoded data, convert and store it for later processing.
+    else if (data_present)
+    {
+        if (convert_samples_into_fifo(input_frame, input_codec_context, output_codec_context,
+                                      resample_context, fifo))
         {
             goto cleanup;
         }
@@ -667,74 +1226,138 @@ static int read_decode_convert_and_store(AVAudioFifo *fifo,
     ret = 0;
 
 cleanup:
-    if (converted_input_samples)
-    {
-        av_freep(&converted_input_samples[0]);
-        free(converted_input_samples);
-    }
-    av_frame_free(&input_frame);
+    av_frame_unref(input_frame);
 
     return ret;
 }
 
+// Free the buffers allocated by init_encode_buffers().
+static void free_encode_buffers(EncodeBuffers *buffers)
+{
+    av_frame_free(&buffers->frame);
+    // The pool is freed once the buffers still referenced are given back.
+    av_buffer_pool_uninit(&buffers->packet_pool);
+}
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
 /*
- Initialize one input frame for writing to the output file.
- The frame will be exactly frame_size samples large.
+ Bytes the encoder may need for the packet of a frame of nb_samples: as much
+ as 64-bit PCM, plus what the other encoders ask for at most, e.g. 8 KB per
+ channel for AAC.
  */
-static int init_output_frame(AVFrame **frame,
-                             AVCodecContext *output_codec_context,
-                             int frame_size)
+static int max_packet_size(const AVCodecContext *output_codec_context, int nb_samples)
 {
-    int error;
+    return (nb_samples + 1024) * output_codec_context->channels * 8;
+}
+
+/*
+ AVCodecContext.get_encode_buffer of the encoders that take their packets
+ from the user (AV_CODEC_CAP_DR1): a buffer of the packet pool, which is
+ the encoder's opaque, if the packet fits in it.
+ */
+static int get_pooled_encode_buffer(AVCodecContext *output_codec_context, AVPacket *packet, int flags)
+{
+    EncodeBuffers *buffers = (EncodeBuffers *)output_codec_context->opaque;
 
-    // Create a new frame to store the audio samples.
-    *frame = av_frame_alloc();
-    if (!(*frame))
+    if (!buffers || !buffers->packet_pool || packet->size > buffers->packet_size)
     {
-        fprintf(stderr, "Could not allocate output frame.\n");
-        return AVERROR_EXIT;
+        return avcodec_default_get_encode_buffer(output_codec_context, packet, flags);
     }
 
-    /*
-     Set the frame's parameters, especially its size and format.
-     av_frame_get_buffer needs this to allocate memory for the
-     audio samples of the frame.
-     Default channel layouts based on the number of channels
-     are assumed for simplicity.
-     */
-    (*frame)->nb_samples     = frame_size;
-    (*frame)->channel_layout = output_codec_context->channel_layout;
-    (*frame)->format         = output_codec_context->sample_fmt;
-    (*frame)->sample_rate    = output_codec_context->sample_rate;
+    packet->buf = av_buffer_pool_get(buffers->packet_pool);
+    if (!packet->buf)
+    {
+        return AVERROR(ENOMEM);
+    }
+    packet->data = packet->buf->data;
 
-    /*
-     Allocate the samples of the created frame. This call will make
-     sure that the audio frame can hold as many samples as specified.
-     */
-    error = av_frame_get_buffer(*frame, 0);
-    if (error < 0)
+    return 0;
+}
+#endif
+
+/*
+ Have the encoder take its packets from the packet pool, if there's one.
+ The encoder may come from the pool of encoders, so it's done for every job.
+ */
+static void attach_encode_buffers(EncodeBuffers *buffers, AVCodecContext *output_codec_context)
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+    if (!buffers->packet_pool)
     {
-        fprintf(stderr, "Could allocate output frame samples.\n");
-        av_frame_free(frame);
+        return;
+    }
+    output_codec_context->opaque            = buffers;
+    output_codec_context->get_encode_buffer = get_pooled_encode_buffer;
+#endif
+}
 
-        return error;
+/*
+ Undo attach_encode_buffers() before the encoder goes back to the pool of
+ encoders, where another session may take it after the buffers are freed.
+ */
+static void detach_encode_buffers(AVCodecContext *output_codec_context)
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+    output_codec_context->opaque            = NULL;
+    output_codec_context->get_encode_buffer = avcodec_default_get_encode_buffer;
+#endif
+}
+
+// Give the session's encoder back to the pool of encoders, detached from the session.
+static void release_encoder(TranscodingSession *session)
+{
+    if (session->output_codec_context)
+    {
+        detach_encode_buffers(session->output_codec_context);
     }
-    else
+    encoder_pool_release(&session->encoder_key, &session->output_codec_context);
+}
+
+/*
+ Allocate the output frame of the encode path, and the packet pool if the
+ encoder takes its packets from it.
+ */
+static int init_encode_buffers(EncodeBuffers *buffers, AVCodecContext *output_codec_context)
+{
+    buffers->frame = av_frame_alloc();
+    if (!buffers->frame)
     {
-        return 0;
+        fprintf(stderr, "Could not allocate output frame.\n");
+        return AVERROR(ENOMEM);
+    }
+
+    // Older libavcodec versions allocate the packets in the encoder.
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+    if (output_codec_context->codec->capabilities & AV_CODEC_CAP_DR1)
+    {
+        buffers->packet_size = max_packet_size(output_codec_context,
+                                               encoder_frame_size(output_codec_context));
+        buffers->packet_pool = av_buffer_pool_init(buffers->packet_size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                                   NULL);
+        if (!buffers->packet_pool)
+        {
+            fprintf(stderr, "Could not allocate buffer pool.\n");
+            free_encode_buffers(buffers);
+            return AVERROR(ENOMEM);
+        }
     }
+#endif
+
+    return 0;
 }
 
-// Encode one frame worth of audio to the output file.
+/*
+ Send one frame worth of audio to the encoder, and write the packets it has
+ ready to the output file: none while it needs more samples, or several.
+ A NULL frame drains the encoder, all its delayed packets are written.
+ */
 static int encode_audio_frame(int64_t *pts, AVFrame *frame,
                               AVFormatContext *output_format_context,
-                              AVCodecContext *output_codec_context,
-                              int *data_present)
+                              AVCodecContext *output_codec_context)
 {
     int error;
     // Packet used for temporary storage.
     AVPacket output_packet;
-    init_packet(&output_packet);
 
     // Set a timestamp based on the sample rate for the container.
     if (frame)
@@ -744,285 +1367,1708 @@ static int encode_audio_frame(int64_t *pts, AVFrame *frame,
     }
 
     /*
-     Encode the audio frame and store it in the temporary packet.
-     The output audio stream encoder is used to do this.
+     Send the audio frame to the output audio stream encoder.
+     It's done with the samples once the call returns.
      */
-    error = avcodec_encode_audio2(output_codec_context, &output_packet, frame, data_present);
+    error = avcodec_send_frame(output_codec_context, frame);
     if (error < 0)
     {
-
-        fprintf(stderr, "Could not encode frame.\n");
-        av_packet_unref(&output_packet);
-
+        fprintf(stderr, "Could not send frame for encoding.\n");
         return error;
     }
 
-    // Write one audio frame from the temporary packet to the output file.
-    if (*data_present)
+    init_packet(&output_packet);
+    while (1)
     {
-        error = av_write_frame(output_format_context, &output_packet);
+        error = avcodec_receive_packet(output_codec_context, &output_packet);
+        if (error == AVERROR(EAGAIN) || error == AVERROR_EOF)
+        {
+            return 0;
+        }
         if (error < 0)
         {
-            fprintf(stderr, "Could not write frame.\n");
-            av_packet_unref(&output_packet);
-
+            fprintf(stderr, "Could not encode frame.\n");
             return error;
         }
 
+        // Write one audio frame from the temporary packet to the output file.
+        error = av_write_frame(output_format_context, &output_packet);
+        // Gives the buffer back to the pool.
         av_packet_unref(&output_packet);
+        if (error < 0)
+        {
+            fprintf(stderr, "Could not write frame.\n");
+            return error;
+        }
     }
-
-    return 0;
 }
 
-// Load one audio frame from the FIFO buffer, encode and write it to the output file.
-static int load_encode_and_write(int64_t *pts, AVAudioFifo *fifo,
-                                 AVFormatContext *output_format_context,
-                                 AVCodecContext *output_codec_context)
+/*
+ Load one audio frame from the FIFO buffer into the output frame of the
+ encode buffers. The frame points into the FIFO, and is given back to it by
+ sample_ring_release_frame().
+ */
+static int load_output_frame(SampleRing *fifo,
+                             AVCodecContext *output_codec_context,
+                             EncodeBuffers *buffers)
 {
-    // Temporary storage of the output samples of the frame written to the file.
-    AVFrame *output_frame;
+    AVFrame *frame = buffers->frame;
     /*
      Use the maximum number of possible samples per frame.
      If there is less than the maximum possible frame size in the FIFO
      buffer use this number. Otherwise, use the maximum possible frame size
      */
-    const int frame_size = FFMIN(av_audio_fifo_size(fifo), output_codec_context->frame_size);
-    int data_written;
-
-    // Initialize temporary storage for one output frame.
-    if (init_output_frame(&output_frame, output_codec_context, frame_size))
-    {
-        return AVERROR_EXIT;
-    }
+    const int frame_size = FFMIN(sample_ring_size(fifo), output_codec_context->frame_size);
 
     /*
-     Read as many samples from the FIFO buffer as required to fill the frame.
-     The samples are stored in the frame temporarily.
+     Set the frame's parameters, especially its size and format.
+     Default channel layouts based on the number of channels
+     are assumed for simplicity.
      */
-    if (av_audio_fifo_read(fifo, (void **)output_frame->data, frame_size) < frame_size)
-    {
-        fprintf(stderr, "Could not read data from FIFO.\n");
-        av_frame_free(&output_frame);
-        return AVERROR_EXIT;
-    }
+    frame->channel_layout = output_codec_context->channel_layout;
+    frame->channels       = output_codec_context->channels;
+    frame->format         = output_codec_context->sample_fmt;
+    frame->sample_rate    = output_codec_context->sample_rate;
 
-    // Encode one frame worth of audio samples.
-    if (encode_audio_frame(pts,
-                           output_frame, output_format_context, output_codec_context,
-                           &data_written))
+    // The samples are a slot of the FIFO, encoded where the resampler wrote them.
+    if (sample_ring_read_frame(fifo, frame, frame_size) < 0)
     {
-        av_frame_free(&output_frame);
+        fprintf(stderr, "Could not read data from FIFO.\n");
+        av_frame_unref(frame);
         return AVERROR_EXIT;
     }
 
-    av_frame_free(&output_frame);
-
     return 0;
 }
 
-static int write_output_file_trailer(AVFormatContext *output_format_context)
+// Load one audio frame from the FIFO buffer, encode and write it to the output file.
+static int load_encode_and_write(int64_t *pts, SampleRing *fifo,
+                                 AVFormatContext *output_format_context,
+                                 AVCodecContext *output_codec_context,
+                                 EncodeBuffers *buffers)
 {
     int error;
 
-    error = av_write_trailer(output_format_context);
-    if (error < 0)
+    if (load_output_frame(fifo, output_codec_context, buffers))
     {
-        fprintf(stderr, "Could not write output file trailer.\n");
-        return error;
+        return AVERROR_EXIT;
+    }
+
+    // Encode one frame worth of audio samples.
+    error = encode_audio_frame(pts,
+                               buffers->frame, output_format_context, output_codec_context);
+
+    // Gives the slot back to the FIFO.
+    sample_ring_release_frame(fifo, buffers->frame);
+
+    return error ? AVERROR_EXIT : 0;
+}
+
+/*
+ Flush the encoder as it may have delayed frames. Encoders without delay
+ aren't drained, so that they're taken again as they are by the next job.
+ */
+static int flush_encoder_output(int64_t *pts,
+                                AVFormatContext *output_format_context,
+                                AVCodecContext *output_codec_context)
+{
+    if (!(output_codec_context->codec->capabilities & AV_CODEC_CAP_DELAY))
+    {
+        return 0;
+    }
+
+    if (encode_audio_frame(pts, NULL, output_format_context, output_codec_context))
+    {
+        return AVERROR_EXIT;
+    }
+
+    return 0;
+}
+
+static int write_output_file_trailer(AVFormatContext *output_format_context)
+{
+    int error;
+
+    error = av_write_trailer(output_format_context);
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not write output file trailer.\n");
+        return error;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+// Allocate the output buffer, for an estimation of the output size in bytes.
+static int init_output_buffer(size_t estimated_bytes, BufferIO **p_bio)
+{
+    BufferIO *bio;
+
+    bio = (BufferIO *)buffer_alloc(sizeof(BufferIO));
+    if (bio == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    bio->buf = (uint8_t *)buffer_alloc(estimated_bytes);
+    if (bio->buf == NULL)
+    {
+        buffer_free(bio);
+        return AVERROR(ENOMEM);
+    }
+    bio->curr   = 0;
+    bio->size   = 0;
+    bio->_total = estimated_bytes;
+    bio->flags  = 0;
+    bio->nb_calls = 0;
+    bio->nb_reallocs = 0;
+    bio->segments = NULL;
+    bio->nb_segments = 0;
+
+    *p_bio = bio;
+
+    return 0;
+}
+
+// How an input is turned into the output
+typedef enum Passthrough {
+    PASSTHROUGH_NONE,  // decoded and encoded again
+    PASSTHROUGH_REMUX, // packets copied into the output container
+    PASSTHROUGH_COPY,  // input bytes copied, the container is the same
+} Passthrough;
+
+// Muxers whose output the demuxer of the same container reads, by their names
+static const struct {
+    const char *muxer;
+    const char *demuxer;
+} same_containers[] = {
+    { "mp3", "mp3" }, { "adts", "aac" }, { "flac", "flac" }, { "wav", "wav" },
+    { "ogg", "ogg" }, { "opus", "ogg" },
+};
+
+// Room for the headers of a remuxed output, over the input size
+#define REMUX_HEADER_SIZE 4096
+
+/*
+ Decide whether the input has to be transcoded: not if it's already in the
+ session's codec, at the requested sample rate and at most at the requested
+ bit rate. Its bytes are copied untouched if the container is the same too,
+ and its duration is known without reading it.
+ */
+static Passthrough select_passthrough(const TranscodingSession *session, const JobIO *io,
+                                      AVFormatContext *input_format_context)
+{
+    const AVCodecParameters *codecpar = input_format_context->streams[0]->codecpar;
+    int64_t bit_rate = codecpar->bit_rate > 0 ? codecpar->bit_rate : input_format_context->bit_rate;
+    size_t i;
+
+    if (io->transcode_always || codecpar->codec_id != session->output_codec->id)
+    {
+        return PASSTHROUGH_NONE;
+    }
+    if (session->args.sample_rate > 0 && session->args.sample_rate != codecpar->sample_rate)
+    {
+        return PASSTHROUGH_NONE;
+    }
+    // An unknown bit rate isn't taken as low enough.
+    if (session->args.bit_rate > 0 && (bit_rate <= 0 || bit_rate > session->args.bit_rate))
+    {
+        return PASSTHROUGH_NONE;
+    }
+
+    if (NULL == io->read_packet && estimate_input_duration(input_format_context, io->src_buf.size) > 0)
+    {
+        for (i = 0; i < sizeof(same_containers) / sizeof(same_containers[0]); i++)
+        {
+            if (strcmp(same_containers[i].muxer, session->output_format->name) == 0 &&
+                strcmp(same_containers[i].demuxer, input_format_context->iformat->name) == 0)
+            {
+                return PASSTHROUGH_COPY;
+            }
+        }
+    }
+
+    return PASSTHROUGH_REMUX;
+}
+
+// Copy the in-memory input as is to the output's I/O context.
+static int copy_input(const JobIO *io, AVIOContext *pb)
+{
+    const BufferData *segments = io->src_segments ? io->src_segments : &io->src_buf;
+    int nb_segments = io->src_segments ? io->nb_src_segments : 1;
+    size_t offset, size;
+    int i;
+
+    for (i = 0; i < nb_segments; i++)
+    {
+        // avio_write() takes an int size.
+        for (offset = 0; offset < segments[i].size; offset += size)
+        {
+            size = FFMIN(segments[i].size - offset, INT_MAX);
+            avio_write(pb, segments[i].buf + offset, (int)size);
+        }
+    }
+    avio_flush(pb);
+
+    return pb->error;
+}
+
+// Set the extradata of the output stream, known once the first packet went through the filter.
+static int set_copied_extradata(AVCodecParameters *codecpar, const AVBSFContext *bsf,
+                                const AVPacket *packet)
+{
+    const uint8_t *extradata = bsf->par_out->extradata;
+    int size = bsf->par_out->extradata_size;
+
+    if (size <= 0)
+    {
+        extradata = av_packet_get_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, &size);
+    }
+    if (NULL == extradata || size <= 0)
+    {
+        return 0;
+    }
+
+    codecpar->extradata = (uint8_t *)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (NULL == codecpar->extradata)
+    {
+        return AVERROR(ENOMEM);
+    }
+    memcpy(codecpar->extradata, extradata, size);
+    codecpar->extradata_size = size;
+
+    return 0;
+}
+
+// Write one copied packet, and the output header before the first one.
+static int write_copied_packet(AVFormatContext *output_format_context, AVRational time_base,
+                               const AVBSFContext *bsf, AVPacket *packet, int *header_written)
+{
+    AVStream *stream = output_format_context->streams[0];
+    int error;
+
+    if (!*header_written)
+    {
+        if (bsf && stream->codecpar->extradata_size == 0)
+        {
+            error = set_copied_extradata(stream->codecpar, bsf, packet);
+            if (error < 0)
+            {
+                return error;
+            }
+        }
+        error = write_output_file_header(output_format_context);
+        if (error < 0)
+        {
+            return error;
+        }
+        *header_written = 1;
+    }
+
+    packet->stream_index = 0;
+    packet->pos          = -1;
+    av_packet_rescale_ts(packet, time_base, stream->time_base);
+
+    error = av_write_frame(output_format_context, packet);
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not write frame.\n");
+    }
+
+    return error;
+}
+
+/*
+ Copy the packets of the input into the output container, with the header
+ and trailer, through aac_adtstoasc for ADTS AAC into a container with
+ global headers.
+ The duration of the packets is returned in nb_samples.
+ */
+static int remux_input(AVFormatContext *input_format_context,
+                       AVFormatContext *output_format_context,
+                       int64_t *nb_samples)
+{
+    AVStream *stream = input_format_context->streams[0];
+    AVRational time_base = stream->time_base;
+    AVBSFContext *bsf = NULL;
+    AVPacket packet;
+    int64_t duration = 0;
+    int header_written = 0, finished = 0, error = 0;
+
+    init_packet(&packet);
+
+    if (stream->codecpar->codec_id == AV_CODEC_ID_AAC && stream->codecpar->extradata_size == 0 &&
+        (output_format_context->oformat->flags & AVFMT_GLOBALHEADER))
+    {
+        if (NULL == adtstoasc_filter)
+        {
+            fprintf(stderr, "Could not find the aac_adtstoasc bitstream filter.\n");
+            return AVERROR_BSF_NOT_FOUND;
+        }
+        error = av_bsf_alloc(adtstoasc_filter, &bsf);
+        if (error < 0)
+        {
+            return error;
+        }
+        bsf->time_base_in = stream->time_base;
+        error = avcodec_parameters_copy(bsf->par_in, stream->codecpar);
+        if (error >= 0)
+        {
+            error = av_bsf_init(bsf);
+        }
+        if (error < 0)
+        {
+            fprintf(stderr, "Could not init the bitstream filter.\n");
+            goto cleanup;
+        }
+        time_base = bsf->time_base_out;
+    }
+
+    while (!finished)
+    {
+        error = av_read_frame(input_format_context, &packet);
+        if (error == AVERROR_EOF)
+        {
+            finished = 1;
+        }
+        else if (error < 0)
+        {
+            fprintf(stderr, "Could not read frame.\n");
+            goto cleanup;
+        }
+        else
+        {
+            duration += packet.duration;
+        }
+
+        if (bsf)
+        {
+            // A NULL packet flushes the filter.
+            error = av_bsf_send_packet(bsf, finished ? NULL : &packet);
+            if (error < 0)
+            {
+                goto cleanup;
+            }
+            while ((error = av_bsf_receive_packet(bsf, &packet)) == 0)
+            {
+                error = write_copied_packet(output_format_context, time_base, bsf, &packet, &header_written);
+                av_packet_unref(&packet);
+                if (error < 0)
+                {
+                    goto cleanup;
+                }
+            }
+            if (error != AVERROR(EAGAIN) && error != AVERROR_EOF)
+            {
+                goto cleanup;
+            }
+        }
+        else if (!finished)
+        {
+            error = write_copied_packet(output_format_context, time_base, NULL, &packet, &header_written);
+            av_packet_unref(&packet);
+            if (error < 0)
+            {
+                goto cleanup;
+            }
+        }
+    }
+
+    // An input without packets still makes a valid output.
+    if (!header_written)
+    {
+        error = write_output_file_header(output_format_context);
+        if (error < 0)
+        {
+            goto cleanup;
+        }
+    }
+
+    error = write_output_file_trailer(output_format_context);
+    if (error < 0)
+    {
+        goto cleanup;
+    }
+
+    // 0 if the packets have no duration, the caller estimates it then.
+    *nb_samples = 0;
+    if (stream->codecpar->sample_rate > 0)
+    {
+        *nb_samples = av_rescale_q(duration, stream->time_base, (AVRational){ 1, stream->codecpar->sample_rate });
+    }
+
+cleanup:
+    av_packet_unref(&packet);
+    av_bsf_free(&bsf);
+
+    return error < 0 ? error : 0;
+}
+
+void get_job_output_info(size_t size, const JobResult *result, int *out_bit_rate, float *out_duration)
+{
+    // E.g. a copied input without packets, or whose packets have no duration
+    if (result->nb_samples <= 0 || result->sample_rate <= 0)
+    {
+        *out_bit_rate = 0;
+        *out_duration = 0;
+        return;
+    }
+
+    *out_duration = (float)result->nb_samples / result->sample_rate;
+
+    *out_bit_rate = 8 * size / *out_duration;
+    *out_bit_rate = *out_bit_rate - *out_bit_rate % 1000;
+}
+
+static const char *const seeking_formats[] = {
+    "m4a", "mp4", "mov", "ipod", "wav", "flac",
+};
+
+int needs_seekable_output(const char *format_name)
+{
+    size_t i;
+
+    for (i = 0; format_name && i < sizeof(seeking_formats) / sizeof(seeking_formats[0]); i++)
+    {
+        if (av_strcasecmp(format_name, seeking_formats[i]) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void transcoding_set_allocator(const TranscodingAllocator *allocator)
+{
+    buffer_set_allocator(allocator);
+}
+
+void transcoding_free_chunk(BufferData *chunk)
+{
+    release_chunk(chunk);
+}
+
+void transcoding_free_chunks(BufferData **p_chunks, int nb_chunks)
+{
+    release_chunks(p_chunks, nb_chunks);
+}
+
+void transcoding_free_output(BufferData *buf)
+{
+    if (buf)
+    {
+        buffer_free(buf->buf);
+        buf->buf  = NULL;
+        buf->size = 0;
+    }
+}
+
+int transcoding_session_create(TranscodingSession **p_session, const TranscodingArgs args)
+{
+    TranscodingSession *session = NULL;
+    int error;
+
+    // Lazy fallback for callers that didn't initialize the library at startup.
+    error = transcoding_global_init();
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not initialize the library.\n");
+        return error;
+    }
+
+    session = (TranscodingSession *)av_mallocz(sizeof(TranscodingSession));
+    if (NULL == session)
+    {
+        fprintf(stderr, "Could not allocate transcoding session.\n");
+        return AVERROR(ENOMEM);
+    }
+
+    session->args = args;
+    av_strlcpy(session->format_name, args.format_name, sizeof(session->format_name));
+    session->args.format_name = session->format_name;
+    if (args.in_format_name)
+    {
+        av_strlcpy(session->in_format_name, args.in_format_name, sizeof(session->in_format_name));
+        session->args.in_format_name = session->in_format_name;
+    }
+
+    error = init_input_options(&session->args, &session->input_options);
+    if (error < 0)
+    {
+        av_free(session);
+        return error;
+    }
+
+    // Find the output container format and the encoder to be used by its name.
+    find_output_format(session->format_name, &session->output_format, &session->output_codec);
+    if (!session->output_format)
+    {
+        fprintf(stderr, "Could not find output format %s.\n", args.format_name);
+        av_free(session);
+        return AVERROR(EINVAL);
+    }
+    if (!session->output_codec)
+    {
+        fprintf(stderr, "Could not find encoder.\n");
+        av_free(session);
+        return AVERROR_EXIT;
+    }
+
+    *p_session = session;
+
+    return 0;
+}
+
+// Free the encoder, resampler and FIFO kept by the session.
+static void release_session_contexts(TranscodingSession *session)
+{
+    sample_ring_free(&session->fifo);
+    resampler_pool_release(&session->resampler_key, &session->resample_context);
+    release_encoder(session);
+    // In the format of the encoder released above
+    free_sample_buffer(&session->converted);
+    free_encode_buffers(&session->encode_buffers);
+
+    session->dirty = 0;
+}
+
+void transcoding_session_reset(TranscodingSession *session)
+{
+    if (!session->dirty)
+    {
+        return;
+    }
+
+    /*
+     Contexts that cannot be reset in place are dropped and rebuilt by the next job,
+     e.g. the drained mp3, aac and opus encoders, see flush_encoder().
+     */
+    if (session->output_codec_context && flush_encoder(session->output_codec_context) != 0)
+    {
+        release_encoder(session);
+    }
+    if (session->resample_context && swr_init(session->resample_context) < 0)
+    {
+        resampler_pool_release(&session->resampler_key, &session->resample_context);
+    }
+    if (session->fifo)
+    {
+        sample_ring_reset(session->fifo);
+    }
+
+    session->dirty = 0;
+}
+
+/*
+ Make the session's encoder, resampler and FIFO ready for the given input.
+ They are kept from the previous job if the input has the same sample rate,
+ sample format and channel count, and rebuilt otherwise.
+ The resampler is left out if with_resampler is 0, or if the encoder takes
+ the decoded samples as they are.
+ */
+static int prepare_session_contexts(TranscodingSession *session,
+                                    AVCodecContext *input_codec_context,
+                                    int with_resampler)
+{
+    int error;
+
+    if (session->in_sample_rate != input_codec_context->sample_rate ||
+        session->in_sample_fmt  != input_codec_context->sample_fmt  ||
+        session->in_channels    != input_codec_context->channels)
+    {
+        release_session_contexts(session);
+
+        session->in_sample_rate = input_codec_context->sample_rate;
+        session->in_sample_fmt  = input_codec_context->sample_fmt;
+        session->in_channels    = input_codec_context->channels;
+    }
+
+    transcoding_session_reset(session);
+
+    if (!session->output_codec_context)
+    {
+        error = open_encoder(session, input_codec_context);
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+
+    if (!session->encode_buffers.frame)
+    {
+        error = init_encode_buffers(&session->encode_buffers, session->output_codec_context);
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+    attach_encode_buffers(&session->encode_buffers, session->output_codec_context);
+
+    // Initialize the resampler to be able to convert audio sample formats.
+    if (with_resampler && !session->resample_context &&
+        needs_resampler(input_codec_context, session->output_codec_context))
+    {
+        error = init_resampler(input_codec_context, session->output_codec_context,
+                               &session->resampler_key, &session->resample_context);
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+
+    // Initialize the FIFO buffer to store audio samples to be encoded.
+    if (!session->fifo)
+    {
+        error = init_fifo(&session->fifo, session->output_codec_context);
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+
+    // The decoded frames are received in the same frame for the session's life.
+    if (!session->input_frame)
+    {
+        error = init_input_frame(&session->input_frame);
+        if (error < 0)
+        {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ Decode, convert and encode the whole input into the output container, with
+ the session's contexts, and write the header and trailer.
+ The number of samples encoded is returned in pts.
+ */
+static int transcode_input(TranscodingSession *session,
+                           AVFormatContext *input_format_context,
+                           AVCodecContext *input_codec_context,
+                           AVFormatContext *output_format_context,
+                           int64_t *pts)
+{
+    AVCodecContext *output_codec_context = session->output_codec_context;
+    SwrContext     *resample_context     = session->resample_context;
+    SampleRing     *fifo                 = session->fifo;
+
+    // Write the header of the output file container.
+    if (write_output_file_header(output_format_context))
+    {
+        return AVERROR_EXIT;
+    }
+
+    /*
+     Loop as long as we have input samples to read or
+     output samples to write; abort as soon as we have neither.
+     */
+    while (1)
+    {
+        // Use the encoder's desired frame size for processing.
+        const int output_frame_size = output_codec_context->frame_size;
+        int finished = 0;
+
+        /*
+         Make sure that there is one frame worth of samples in the FIFO
+         buffer so that the encoder can do its work.
+         Since the decoder's and the encoder's frame size may differ, we
+         need to FIFO buffer to store as many frames worth of input samples
+         that they make up at least one frame worth of output samples.
+        */
+        while (sample_ring_size(fifo) < output_frame_size)
+        {
+            /*
+              Decode one frame worth of audio samples, convert it to the
+              output sample format and put it into the FIFO buffer.
+             */
+            if (read_decode_convert_and_store(fifo, session->input_frame,
+                                              input_format_context,
+                                              input_codec_context,
+                                              output_codec_context,
+                                              resample_context, &finished))
+            {
+                return AVERROR_EXIT;
+            }
+
+            /*
+             If we are at the end of the input file, we continue
+             encoding the remaining audio samples to the output file.
+             */
+            if (finished)
+            {
+                break;
+            }
+        }
+
+        /*
+         If we have enough samples for the encoder, we encode them.
+         At the end of the file, we pass the remaining samples to
+         the encoder.
+         */
+        while (sample_ring_size(fifo) >= output_frame_size ||
+               (finished && sample_ring_size(fifo) > 0))
+        {
+            /*
+            Take one frame worth of audio samples from the FIFO buffer,
+            encode it and write it to the output file.
+            */
+            if (load_encode_and_write(pts, fifo, output_format_context, output_codec_context,
+                                      &session->encode_buffers))
+            {
+                return AVERROR_EXIT;
+            }
+        }
+
+        /*
+         If we are at the end of the input file and have encoded
+         all remaining samples, we can exit this loop and finish.
+         */
+        if (finished)
+        {
+            if (flush_encoder_output(pts, output_format_context, output_codec_context))
+            {
+                return AVERROR_EXIT;
+            }
+
+            break;
+        }
+    }
+
+    // Write the trailer of the output file container.
+    if (write_output_file_trailer(output_format_context))
+    {
+        return AVERROR_EXIT;
+    }
+
+    return 0;
+}
+
+int transcoding_session_run(TranscodingSession *session, const JobIO *io, JobResult *result)
+{
+    int ret = AVERROR_EXIT;
+    AVFormatContext *input_format_context = NULL, *output_format_context = NULL;
+    AVCodecContext  *input_codec_context = NULL;
+    AVStream        *copy_stream = NULL;
+    DecoderKey       decoder_key;
+    BufferIO        *bio = NULL;
+    Passthrough      passthrough;
+    size_t           output_estimate = 0, estimated_bytes;
+    int              sample_rate;
+    int64_t pts = 0; // Global timestamp for the audio frames
+
+    result->bio = NULL;
+
+    if (open_input_stream(io, &session->input_options,
+                          &input_format_context, &input_codec_context, &decoder_key))
+    {
+        goto cleanup;
+    }
+
+    passthrough = select_passthrough(session, io, input_format_context);
+    if (passthrough == PASSTHROUGH_NONE)
+    {
+        if (prepare_session_contexts(session, input_codec_context, 1))
+        {
+            goto cleanup;
+        }
+
+        session->dirty = 1;
+
+        sample_rate     = session->output_codec_context->sample_rate;
+        estimated_bytes = estimate_output_size(input_format_context, io->src_buf.size,
+                                               session->output_format, session->output_codec_context);
+    }
+    else
+    {
+        copy_stream     = input_format_context->streams[0];
+        sample_rate     = copy_stream->codecpar->sample_rate;
+        estimated_bytes = io->src_buf.size + (passthrough == PASSTHROUGH_REMUX ? REMUX_HEADER_SIZE : 0);
+    }
+
+    if (io->write_packet || (io->dst_chunks && NULL == io->dst_region))
+    {
+        // written by the callback, or to the chunks
+    }
+    else if (io->dst_region)
+    {
+        bio = (BufferIO *)buffer_alloc(sizeof(BufferIO));
+        if (bio == NULL)
+        {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+        bio->buf    = io->dst_region->buf;
+        bio->curr   = 0;
+        bio->size   = 0;
+        bio->_total = io->dst_region->size;
+        bio->flags  = BUFFER_IO_BORROWED | (io->dst_spill ? 0 : BUFFER_IO_FIXED);
+        bio->nb_calls = 0;
+        bio->nb_reallocs = 0;
+        bio->segments = NULL;
+        bio->nb_segments = 0;
+    }
+    else if (init_output_buffer(estimated_bytes, &bio))
+    {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    else
+    {
+        output_estimate = bio->_total;
+    }
+
+    if (open_output_stream(session, io, bio, copy_stream, &output_format_context))
+    {
+        goto cleanup;
+    }
+
+    if (passthrough == PASSTHROUGH_COPY)
+    {
+        // The duration is known from the header, see select_passthrough().
+        if (copy_input(io, output_format_context->pb) < 0)
+        {
+            goto cleanup;
+        }
+        pts = (int64_t)(estimate_input_duration(input_format_context, io->src_buf.size) * sample_rate + 0.5);
+    }
+    else if (passthrough == PASSTHROUGH_REMUX)
+    {
+        if (remux_input(input_format_context, output_format_context, &pts))
+        {
+            goto cleanup;
+        }
+        // Packets without duration sum up to 0.
+        if (pts <= 0)
+        {
+            pts = (int64_t)(estimate_input_duration(input_format_context, io->src_buf.size) * sample_rate + 0.5);
+        }
+    }
+    else if (transcode_input(session, input_format_context, input_codec_context,
+                             output_format_context, &pts))
+    {
+        goto cleanup;
+    }
+
+    // The slack isn't worth a copy if the result isn't kept, a failure keeps it.
+    if (bio && session->args.shrink_output)
+    {
+        shrink_buffer_io(bio);
+    }
+
+    result->bio         = bio;
+    result->nb_samples  = pts;
+    result->sample_rate = sample_rate;
+
+    memset(&result->stats, 0, sizeof(TranscodingStats));
+    if (NULL == io->read_packet)
+    {
+        result->stats.nb_read_calls = ((BufferIO *)input_format_context->pb->opaque)->nb_calls;
+    }
+    if (io->dst_chunks && NULL == bio)
+    {
+        result->stats.output_capacity = (size_t)io->dst_chunks->nb_chunks * BUFFER_CHUNK_SIZE;
+        result->stats.nb_write_calls  = io->dst_chunks->nb_calls;
+    }
+    if (bio)
+    {
+        result->stats.output_estimate = output_estimate;
+        result->stats.nb_reallocs     = bio->nb_reallocs;
+        result->stats.output_capacity = bio->_total;
+        result->stats.nb_write_calls  = bio->nb_calls;
+    }
+    session->stats = result->stats;
+
+    bio = NULL;
+    ret = 0;
+
+cleanup:
+    if (output_format_context)
+    {
+        close_output_stream(&output_format_context);
+    }
+    free_output_buffer(&bio);
+    if (input_codec_context)
+    {
+        decoder_pool_release(&decoder_key, &input_codec_context);
+    }
+    if (input_format_context)
+    {
+        close_input_stream(io, &input_format_context);
+    }
+
+    return ret;
+}
+
+int transcoding_session_transcode(TranscodingSession *session,
+                                  BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                                  const BufferData src_buf)
+{
+    JobIO io;
+    JobResult result;
+    int ret;
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf = src_buf;
+
+    ret = transcoding_session_run(session, &io, &result);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    p_dst_buf->buf = result.bio->buf;
+    p_dst_buf->size = result.bio->size;
+
+    get_job_output_info(result.bio->size, &result, out_bit_rate, out_duration);
+
+    buffer_free(result.bio);
+
+    return 0;
+}
+
+int transcoding_session_transcode_segments(TranscodingSession *session,
+                                           BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                                           const BufferData *src_segments, int nb_segments)
+{
+    JobIO io;
+    JobResult result;
+    int ret, i;
+
+    if (nb_segments <= 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_segments    = src_segments;
+    io.nb_src_segments = nb_segments;
+    for (i = 0; i < nb_segments; i++)
+    {
+        io.src_buf.size += src_segments[i].size;
+    }
+
+    ret = transcoding_session_run(session, &io, &result);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    p_dst_buf->buf = result.bio->buf;
+    p_dst_buf->size = result.bio->size;
+
+    get_job_output_info(result.bio->size, &result, out_bit_rate, out_duration);
+
+    buffer_free(result.bio);
+
+    return 0;
+}
+
+int transcoding_session_transcode_into(TranscodingSession *session,
+                                       BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                                       const BufferData src_buf, int spill)
+{
+    JobIO io;
+    JobResult result;
+    BufferData region = *p_dst_buf;
+    int ret;
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf    = src_buf;
+    io.dst_region = &region;
+    io.dst_spill  = spill;
+
+    ret = transcoding_session_run(session, &io, &result);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    p_dst_buf->buf  = result.bio->buf;
+    p_dst_buf->size = result.bio->size;
+
+    if (result.bio->size > result.bio->_total)
+    {
+        // Only a fixed region is outgrown, report the required size.
+        ret = AVERROR(ENOSPC);
     }
     else
     {
-        return 0;
+        get_job_output_info(result.bio->size, &result, out_bit_rate, out_duration);
+    }
+
+    buffer_free(result.bio);
+
+    return ret;
+}
+
+int transcoding_session_transcode_chunked(TranscodingSession *session,
+                                          BufferData **p_chunks, int *nb_chunks,
+                                          int *out_bit_rate, float *out_duration,
+                                          const BufferData src_buf)
+{
+    JobIO io;
+    JobResult result;
+    ChunkedIO cio;
+    int ret;
+
+    memset(&cio, 0, sizeof(ChunkedIO));
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf    = src_buf;
+    io.dst_chunks = &cio;
+
+    ret = transcoding_session_run(session, &io, &result);
+    if (ret < 0)
+    {
+        release_chunks(&cio.chunks, cio.nb_chunks);
+        return ret;
+    }
+
+    *p_chunks  = cio.chunks;
+    *nb_chunks = cio.nb_chunks;
+
+    get_job_output_info(cio.size, &result, out_bit_rate, out_duration);
+
+    return 0;
+}
+
+// Output forwarded to the caller's sink, the bytes are counted for the bit rate.
+typedef struct SinkIO {
+    const TranscodingSink *sink;
+    size_t                 written;
+} SinkIO;
+
+static int sink_write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    SinkIO *sio = (SinkIO *)opaque;
+    int error;
+
+    error = sio->sink->write(sio->sink->opaque, buf, buf_size);
+    if (error < 0)
+    {
+        return error;
+    }
+    sio->written += buf_size;
+
+    return buf_size;
+}
+
+int transcoding_session_transcode_to_sink(TranscodingSession *session,
+                                          const TranscodingSink *sink,
+                                          int *out_bit_rate, float *out_duration,
+                                          const BufferData src_buf)
+{
+    JobIO io;
+    JobResult result;
+    SinkIO sio;
+    int ret;
+
+    if (needs_seekable_output(session->format_name))
+    {
+        fprintf(stderr, "Format %s needs a seekable output, which a sink isn't.\n",
+                session->format_name);
+        return AVERROR(EINVAL);
+    }
+
+    sio.sink    = sink;
+    sio.written = 0;
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf           = src_buf;
+    io.write_opaque      = &sio;
+    io.write_packet      = &sink_write_packet;
+    io.write_buffer_size = sink->flush_threshold > 0 ? (int)FFMIN(sink->flush_threshold, INT_MAX) : 0;
+
+    ret = transcoding_session_run(session, &io, &result);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    get_job_output_info(sio.written, &result, out_bit_rate, out_duration);
+
+    return 0;
+}
+
+const TranscodingArgs *transcoding_session_args(const TranscodingSession *session)
+{
+    return &session->args;
+}
+
+void transcoding_session_get_stats(const TranscodingSession *session, TranscodingStats *stats)
+{
+    *stats = session->stats;
+}
+
+void transcoding_session_destroy(TranscodingSession **p_session)
+{
+    if (NULL == p_session || NULL == *p_session)
+    {
+        return;
+    }
+
+    release_session_contexts(*p_session);
+    av_frame_free(&(*p_session)->input_frame);
+    av_freep(p_session);
+}
+
+int transcoding(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration, const TranscodingArgs args, const BufferData src_buf)
+{
+    TranscodingSession *session = NULL;
+    int ret;
+
+    ret = transcoding_session_create(&session, args);
+    if (ret < 0)
+    {
+        return ret;
     }
+
+    ret = transcoding_session_transcode(session, p_dst_buf, out_bit_rate, out_duration, src_buf);
+
+    transcoding_session_destroy(&session);
+
+    return ret;
 }
 
-int transcoding(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration, const TranscodingArgs args, const BufferData src_buf)
+// Max frames worth of samples buffered for an output whose encoder runs on its own thread.
+#define FANOUT_MAX_BUFFERED_FRAMES 16
+
+/*
+ One output of a fan-out transcode. Its session provides the encoder and the
+ FIFO. The samples come from the resampler of the first output of its stage,
+ i.e. of the first output whose encoder takes the same samples.
+ */
+typedef struct FanoutOutput {
+    TranscodingSession *session;
+    int                 stage; // index of the output owning the stage's resampler
+    BufferIO           *bio;
+    AVFormatContext    *output_format_context;
+    int64_t             pts;
+
+    // Only used when the encoder runs on its own thread.
+    pthread_t           thread;
+    int                 thread_started;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    int                 finished;
+    int                 error;
+} FanoutOutput;
+
+// Whether two encoders take the same samples, so that they can share a resampler.
+static int same_encoder_input(AVCodecContext *a, AVCodecContext *b)
 {
-    int ret = AVERROR(AVERROR_EXIT);
-    AVFormatContext *input_format_context = NULL, *output_format_context = NULL;
-    AVCodecContext  *input_codec_context = NULL,  *output_codec_context = NULL;
-    SwrContext      *resample_context = NULL;
-    AVAudioFifo     *fifo = NULL;
-    int64_t pts = 0; // Global timestamp for the audio frames
+    return a->sample_rate    == b->sample_rate &&
+           a->sample_fmt     == b->sample_fmt  &&
+           a->channel_layout == b->channel_layout;
+}
 
-    av_register_all();
+// Encode the samples of one output on its own thread, as the decoding thread stores them.
+static void *fanout_encoder_main(void *arg)
+{
+    FanoutOutput *output = (FanoutOutput *)arg;
+    AVCodecContext *output_codec_context = output->session->output_codec_context;
+    SampleRing *fifo = output->session->fifo;
+    const int output_frame_size = output_codec_context->frame_size;
+    EncodeBuffers *buffers = &output->session->encode_buffers;
+    int error = 0;
 
-    if (open_input_stream(src_buf, &input_format_context, &input_codec_context))
+    pthread_mutex_lock(&output->lock);
+    while (!output->error)
     {
-        goto cleanup;
+        while (sample_ring_size(fifo) < output_frame_size && !output->finished && !output->error)
+        {
+            pthread_cond_wait(&output->cond, &output->lock);
+        }
+        if (output->error || sample_ring_size(fifo) == 0)
+        {
+            break;
+        }
+
+        // The frame points into the FIFO, which the decoding thread only writes after it.
+        error = load_output_frame(fifo, output_codec_context, buffers);
+        pthread_mutex_unlock(&output->lock);
+
+        if (!error)
+        {
+            error = encode_audio_frame(&output->pts, buffers->frame,
+                                       output->output_format_context, output_codec_context);
+        }
+
+        pthread_mutex_lock(&output->lock);
+        sample_ring_release_frame(fifo, buffers->frame);
+
+        // Let the decoding thread know there is room for more samples.
+        pthread_cond_signal(&output->cond);
+        if (error)
+        {
+            output->error = AVERROR_EXIT;
+            pthread_cond_signal(&output->cond);
+        }
     }
+    error = output->error;
+    pthread_mutex_unlock(&output->lock);
 
-    // Estimate output buffer size in bytes
-    size_t estimated_bytes;
-    if (args.bit_rate > 0)
+    if (!error && flush_encoder_output(&output->pts, output->output_format_context,
+                                       output_codec_context))
     {
-        AVStream *audio_stream = input_format_context->streams[0];
-        double duration = audio_stream->duration * av_q2d(audio_stream->time_base);
-        estimated_bytes= args.bit_rate * duration / 8;
+        pthread_mutex_lock(&output->lock);
+        output->error = AVERROR_EXIT;
+        pthread_mutex_unlock(&output->lock);
     }
-    else
+
+    return NULL;
+}
+
+/*
+ Store converted samples in the FIFO of one output. If its encoder runs on
+ its own thread, wait for it while it is too far behind, or while the FIFO
+ has to grow under the frames its encoder still references.
+ */
+static int store_fanout_samples(FanoutOutput *output, int parallel,
+                                uint8_t **converted_input_samples, const int frame_size)
+{
+    SampleRing *fifo = output->session->fifo;
+    const int max_buffered = FANOUT_MAX_BUFFERED_FRAMES *
+                             FFMAX(output->session->output_codec_context->frame_size, 1);
+    int error;
+
+    if (!parallel)
     {
-        estimated_bytes = src_buf.size / 18;
+        return add_samples_to_fifo(fifo, converted_input_samples, frame_size);
     }
 
-    BufferIO * bio = (BufferIO *)av_malloc(sizeof(BufferIO));
+    pthread_mutex_lock(&output->lock);
+    while ((sample_ring_size(fifo) >= max_buffered || !sample_ring_can_write(fifo, frame_size)) &&
+           !output->error)
+    {
+        pthread_cond_wait(&output->cond, &output->lock);
+    }
 
-    bio->buf = (uint8_t *)av_malloc(estimated_bytes);
-    if (bio->buf == NULL)
+    error = output->error;
+    if (!error)
     {
-        ret = AVERROR(ENOMEM);
-        goto cleanup;
+        error = add_samples_to_fifo(fifo, converted_input_samples, frame_size);
     }
-    bio->curr   = 0;
-    bio->size   = 0;
-    bio->_total = estimated_bytes;
 
-    if (open_output_stream(args, bio, input_codec_context,
-                           &output_format_context, &output_codec_context))
+    pthread_cond_signal(&output->cond);
+    pthread_mutex_unlock(&output->lock);
+
+    return error;
+}
+
+// Tell the encoder thread of an output that no more samples come, and wait for it.
+static void stop_fanout_encoder(FanoutOutput *output, int abort)
+{
+    if (!output->thread_started)
     {
-        goto cleanup;
+        return;
     }
 
-    // Initialize the resampler to be able to convert audio sample formats.
-    if (init_resampler(input_codec_context, output_codec_context, &resample_context))
+    pthread_mutex_lock(&output->lock);
+    output->finished = 1;
+    if (abort && !output->error)
     {
-        goto cleanup;
+        output->error = AVERROR_EXIT;
     }
+    pthread_cond_signal(&output->cond);
+    pthread_mutex_unlock(&output->lock);
 
-    // Initialize the FIFO buffer to store audio samples to be encoded.
-    if (init_fifo(&fifo, output_codec_context))
+    pthread_join(output->thread, NULL);
+    output->thread_started = 0;
+}
+
+int transcoding_multi(BufferData *dst_bufs, int *out_bit_rates, float *out_durations,
+                      const TranscodingArgs *args, int nb_outputs,
+                      const BufferData src_buf, const TranscodingMultiOptions *opts)
+{
+    int ret = AVERROR_EXIT;
+    const int parallel = opts && opts->parallel_encoders;
+    AVFormatContext *input_format_context = NULL;
+    AVCodecContext  *input_codec_context = NULL;
+    DecoderKey       decoder_key;
+    JobIO            io;
+    FanoutOutput    *outputs = NULL;
+    // Temporary storage of the input samples of the frame read from the file.
+    AVFrame         *input_frame = NULL;
+    int i, j, data_present, finished = 0;
+    InputOptions     input_options;
+
+    if (nb_outputs <= 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    outputs = (FanoutOutput *)av_calloc(nb_outputs, sizeof(FanoutOutput));
+    if (NULL == outputs)
+    {
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < nb_outputs; i++)
+    {
+        pthread_mutex_init(&outputs[i].lock, NULL);
+        pthread_cond_init(&outputs[i].cond, NULL);
+    }
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf = src_buf;
+
+    // The input is shared, open it as the first output asks, by the largest buffer asked for.
+    ret = init_input_options(&args[0], &input_options);
+    if (ret < 0)
     {
         goto cleanup;
     }
+    ret = AVERROR_EXIT;
+    for (i = 0; i < nb_outputs; i++)
+    {
+        input_options.buffer_size = FFMAX(input_options.buffer_size, args[i].in_buffer_size);
+    }
 
-    // Write the header of the output file container.
-    if (write_output_file_header(output_format_context))
+    if (open_input_stream(&io, &input_options,
+                          &input_format_context, &input_codec_context, &decoder_key))
     {
         goto cleanup;
     }
 
-    /*
-     Loop as long as we have input samples to read or
-     output samples to write; abort as soon as we have neither.
-     */
-    while (1)
+    for (i = 0; i < nb_outputs; i++)
     {
-        // Use the encoder's desired frame size for processing.
-        const int output_frame_size = output_codec_context->frame_size;
-        int finished = 0;
+        FanoutOutput *output = &outputs[i];
 
-        /*
-         Make sure that there is one frame worth of samples in the FIFO
-         buffer so that the encoder can do its work.
-         Since the decoder's and the encoder's frame size may differ, we
-         need to FIFO buffer to store as many frames worth of input samples
-         that they make up at least one frame worth of output samples.
-        */
-        while (av_audio_fifo_size(fifo) < output_frame_size)
+        ret = transcoding_session_create(&output->session, args[i]);
+        if (ret < 0)
         {
-            /*
-              Decode one frame worth of audio samples, convert it to the
-              output sample format and put it into the FIFO buffer.
-             */
-            if (read_decode_convert_and_store(fifo, input_format_context,
-                                              input_codec_context,
-                                              output_codec_context,
-                                              resample_context, &finished))
-            {
-                goto cleanup;
-            }
+            goto cleanup;
+        }
+        ret = AVERROR_EXIT;
 
-            /*
-             If we are at the end of the input file, we continue
-             encoding the remaining audio samples to the output file.
-             */
-            if (finished)
+        if (prepare_session_contexts(output->session, input_codec_context, 0))
+        {
+            goto cleanup;
+        }
+
+        output->session->dirty = 1;
+
+        // Share the resampler of the first output whose encoder takes the same samples.
+        output->stage = i;
+        for (j = 0; j < i; j++)
+        {
+            if (outputs[j].stage == j &&
+                same_encoder_input(outputs[j].session->output_codec_context,
+                                   output->session->output_codec_context))
             {
+                output->stage = j;
                 break;
             }
         }
 
-        /*
-         If we have enough samples for the encoder, we encode them.
-         At the end of the file, we pass the remaining samples to
-         the encoder.
-         */
-        while (av_audio_fifo_size(fifo) >= output_frame_size ||
-               (finished && av_audio_fifo_size(fifo) > 0))
+        if (output->stage == i &&
+            needs_resampler(input_codec_context, output->session->output_codec_context) &&
+            init_resampler(input_codec_context, output->session->output_codec_context,
+                           &output->session->resampler_key, &output->session->resample_context))
         {
-            /*
-            Take one frame worth of audio samples from the FIFO buffer,
-            encode it and write it to the output file.
-            */
-            if (load_encode_and_write(&pts, fifo, output_format_context, output_codec_context))
+            goto cleanup;
+        }
+
+        if (init_output_buffer(estimate_output_size(input_format_context, src_buf.size,
+                                                    output->session->output_format,
+                                                    output->session->output_codec_context),
+                               &output->bio))
+        {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+
+        if (open_output_stream(output->session, NULL, output->bio, NULL, &output->output_format_context))
+        {
+            goto cleanup;
+        }
+
+        // Write the header of the output file container.
+        if (write_output_file_header(output->output_format_context))
+        {
+            goto cleanup;
+        }
+    }
+
+    if (parallel)
+    {
+        for (i = 0; i < nb_outputs; i++)
+        {
+            if (pthread_create(&outputs[i].thread, NULL, &fanout_encoder_main, &outputs[i]) != 0)
             {
+                fprintf(stderr, "Could not start encoder thread.\n");
                 goto cleanup;
             }
+            outputs[i].thread_started = 1;
+        }
+    }
+
+    // Initialize temporary storage for one input frame.
+    if (init_input_frame(&input_frame))
+    {
+        goto cleanup;
+    }
+
+    while (!finished)
+    {
+        // Decode one frame worth of audio samples.
+        if (decode_audio_frame(input_frame, input_format_context, input_codec_context,
+                               &data_present, &finished))
+        {
+            goto cleanup;
+        }
+
+        // Convert the samples once per stage, and store them for every output of the stage.
+        for (i = 0; data_present && i < nb_outputs; i++)
+        {
+            uint8_t **stage_samples;
+            int stage_nb_samples;
+
+            if (outputs[i].stage != i)
+            {
+                continue;
+            }
+
+            // A stage without resampler takes the decoded samples as they are.
+            if (NULL == outputs[i].session->resample_context)
+            {
+                stage_samples    = input_frame->extended_data;
+                stage_nb_samples = input_frame->nb_samples;
+            }
+            else
+            {
+                /*
+                 The stage's samples go to the FIFO of each of its outputs,
+                 so they're converted once into the stage's own storage.
+                 */
+                SampleBuffer *converted = &outputs[i].session->converted;
+
+                if (grow_sample_buffer(converted, outputs[i].session->output_codec_context,
+                                       max_converted_samples(input_frame, input_codec_context,
+                                                             outputs[i].session->output_codec_context,
+                                                             outputs[i].session->resample_context)) ||
+                    convert_samples(input_frame, outputs[i].session->resample_context,
+                                    converted->data, converted->capacity, &stage_nb_samples))
+                {
+                    goto cleanup;
+                }
+                stage_samples = converted->data;
+            }
+
+            for (j = i; j < nb_outputs; j++)
+            {
+                if (outputs[j].stage == i &&
+                    store_fanout_samples(&outputs[j], parallel,
+                                         stage_samples, stage_nb_samples))
+                {
+                    goto cleanup;
+                }
+            }
+        }
+        av_frame_unref(input_frame);
+
+        if (parallel)
+        {
+            continue;
         }
 
         /*
-         If we are at the end of the input file and have encoded
-         all remaining samples, we can exit this loop and finish.
+         Encode as many frames as the FIFO buffers hold for each output.
+         At the end of the file, we pass the remaining samples to the encoders.
          */
-        if (finished)
+        for (i = 0; i < nb_outputs; i++)
         {
-            int data_written;
-            // Flush the encoder as it may have delayed frames.
-            do
+            FanoutOutput *output = &outputs[i];
+            SampleRing *fifo = output->session->fifo;
+            AVCodecContext *output_codec_context = output->session->output_codec_context;
+
+            while (sample_ring_size(fifo) >= output_codec_context->frame_size ||
+                   (finished && sample_ring_size(fifo) > 0))
             {
-                if (encode_audio_frame(&pts, NULL,
-                                       output_format_context, output_codec_context,
-                                       &data_written))
+                if (load_encode_and_write(&output->pts, fifo,
+                                          output->output_format_context, output_codec_context,
+                                          &output->session->encode_buffers))
                 {
                     goto cleanup;
                 }
-            } while (data_written);
+            }
 
-            break;
+            if (finished &&
+                flush_encoder_output(&output->pts, output->output_format_context,
+                                     output_codec_context))
+            {
+                goto cleanup;
+            }
         }
     }
 
-    // Write the trailer of the output file container.
-    if (write_output_file_trailer(output_format_context))
+    for (i = 0; i < nb_outputs; i++)
     {
-        goto cleanup;
+        stop_fanout_encoder(&outputs[i], 0);
+        if (outputs[i].error)
+        {
+            goto cleanup;
+        }
+    }
+
+    // Write the trailer of every output file container.
+    for (i = 0; i < nb_outputs; i++)
+    {
+        if (write_output_file_trailer(outputs[i].output_format_context))
+        {
+            goto cleanup;
+        }
     }
 
-    p_dst_buf->buf = bio->buf;
-    p_dst_buf->size = bio->size;
+    for (i = 0; i < nb_outputs; i++)
+    {
+        JobResult result;
+        int out_bit_rate;
+        float out_duration;
+
+        result.bio         = outputs[i].bio;
+        result.nb_samples  = outputs[i].pts;
+        result.sample_rate = outputs[i].session->output_codec_context->sample_rate;
 
-    *out_duration = (float)pts / output_codec_context->sample_rate;
+        dst_bufs[i].buf  = outputs[i].bio->buf;
+        dst_bufs[i].size = outputs[i].bio->size;
 
-    *out_bit_rate = 8 * bio->size / *out_duration;
-    *out_bit_rate = *out_bit_rate - *out_bit_rate % 1000;
+        get_job_output_info(outputs[i].bio->size, &result, &out_bit_rate, &out_duration);
+
+        // The data is handed over, only the struct is freed.
+        buffer_free(outputs[i].bio);
+        outputs[i].bio = NULL;
+
+        if (out_bit_rates)
+        {
+            out_bit_rates[i] = out_bit_rate;
+        }
+        if (out_durations)
+        {
+            out_durations[i] = out_duration;
+        }
+    }
 
     ret = 0;
 
 cleanup:
-    if (fifo)
-    {
-        av_audio_fifo_free(fifo);
-    }
-    swr_free(&resample_context);
-    if (output_codec_context)
+    for (i = 0; i < nb_outputs; i++)
     {
-        avcodec_free_context(&output_codec_context);
+        stop_fanout_encoder(&outputs[i], 1);
     }
-    if (output_format_context)
+    av_frame_free(&input_frame);
+    for (i = 0; i < nb_outputs; i++)
     {
-        // avio_closep(&(output_format_context->pb)); // DEBUG: exc bad access
-        avformat_free_context(output_format_context);
+        if (outputs[i].output_format_context)
+        {
+            close_output_stream(&outputs[i].output_format_context);
+        }
+        free_output_buffer(&outputs[i].bio);
+        transcoding_session_destroy(&outputs[i].session);
+        pthread_mutex_destroy(&outputs[i].lock);
+        pthread_cond_destroy(&outputs[i].cond);
     }
+    av_free(outputs);
     if (input_codec_context)
     {
-        avcodec_free_context(&input_codec_context);
+        decoder_pool_release(&decoder_key, &input_codec_context);
     }
     if (input_format_context)
     {
-        avformat_close_input(&input_format_context);
+        close_input_stream(&io, &input_format_context);
+    }
+
+    return ret;
+}
+
+int transcoding_to_sink(const TranscodingSink *sink, int *out_bit_rate, float *out_duration,
+                        const TranscodingArgs args, const BufferData src_buf)
+{
+    TranscodingSession *session = NULL;
+    int ret;
+
+    // Rejected before the session is set up for nothing.
+    if (needs_seekable_output(args.format_name))
+    {
+        fprintf(stderr, "Format %s needs a seekable output, which a sink isn't.\n", args.format_name);
+        return AVERROR(EINVAL);
+    }
+
+    ret = transcoding_session_create(&session, args);
+    if (ret < 0)
+    {
+        return ret;
     }
 
+    ret = transcoding_session_transcode_to_sink(session, sink, out_bit_rate, out_duration, src_buf);
+
+    transcoding_session_destroy(&session);
+
+    return ret;
+}
+
+int transcoding_into(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                     const TranscodingArgs args, const BufferData src_buf, int spill)
+{
+    TranscodingSession *session = NULL;
+    int ret;
+
+    ret = transcoding_session_create(&session, args);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = transcoding_session_transcode_into(session, p_dst_buf, out_bit_rate, out_duration,
+                                             src_buf, spill);
+
+    transcoding_session_destroy(&session);
+
+    return ret;
+}
+
+int transcoding_chunked(BufferData **p_chunks, int *nb_chunks, int *out_bit_rate, float *out_duration,
+                        const TranscodingArgs args, const BufferData src_buf)
+{
+    TranscodingSession *session = NULL;
+    int ret;
+
+    ret = transcoding_session_create(&session, args);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = transcoding_session_transcode_chunked(session, p_chunks, nb_chunks,
+                                                out_bit_rate, out_duration, src_buf);
+
+    transcoding_session_destroy(&session);
+
+    return ret;
+}
+
+int transcoding_segments(BufferData *p_dst_buf, int *out_bit_rate, float *out_duration,
+                         const TranscodingArgs args, const BufferData *src_segments, int nb_segments)
+{
+    TranscodingSession *session = NULL;
+    int ret;
+
+    ret = transcoding_session_create(&session, args);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = transcoding_session_transcode_segments(session, p_dst_buf, out_bit_rate, out_duration,
+                                                 src_segments, nb_segments);
+
+    transcoding_session_destroy(&session);
+
     return ret;
 }
 
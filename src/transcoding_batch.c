@@ -0,0 +1,336 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/mem.h>
+
+#include "transcoding.h"
+
+
+// Sessions kept warm by each worker, for the most recently used args.
+#define SESSIONS_PER_WORKER 4
+
+typedef struct CachedSession {
+    TranscodingArgs     args;
+    char                format_name[32];
+    char                in_format_name[32];
+    TranscodingSession *session;
+    uint64_t            last_used;
+} CachedSession;
+
+// Jobs of one transcoding_batch() call.
+typedef struct Batch {
+    TranscodingJob *jobs;
+    size_t          nb_jobs;
+    size_t          next_job;
+    size_t          nb_done;
+    int             max_workers;
+    int             nb_running;
+    pthread_cond_t  done_cond;
+    struct Batch   *next;
+} Batch;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;
+    Batch          *batches;
+    pthread_t      *threads;
+    int             nb_workers;
+    int             stopping;
+} worker_pool = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+// Find a warm session for the args, creating one in place of the least recently used if none.
+static int get_session(CachedSession *cache, uint64_t *tick,
+                       const TranscodingArgs args, TranscodingSession **p_session)
+{
+    CachedSession *slot = &cache[0];
+    int i, error;
+
+    *tick = *tick + 1;
+
+    for (i = 0; i < SESSIONS_PER_WORKER; i++)
+    {
+        if (cache[i].session &&
+            cache[i].args.sample_rate == args.sample_rate &&
+            cache[i].args.bit_rate == args.bit_rate &&
+            cache[i].args.in_buffer_size == args.in_buffer_size &&
+            cache[i].args.out_buffer_size == args.out_buffer_size &&
+            cache[i].args.shrink_output == args.shrink_output &&
+            cache[i].args.probesize == args.probesize &&
+            cache[i].args.analyze_duration == args.analyze_duration &&
+            strcmp(cache[i].in_format_name, args.in_format_name ? args.in_format_name : "") == 0 &&
+            strcmp(cache[i].format_name, args.format_name) == 0)
+        {
+            cache[i].last_used = *tick;
+            *p_session = cache[i].session;
+            return 0;
+        }
+        if (cache[i].last_used < slot->last_used)
+        {
+            slot = &cache[i];
+        }
+    }
+
+    transcoding_session_destroy(&slot->session);
+
+    error = transcoding_session_create(&slot->session, args);
+    if (error < 0)
+    {
+        slot->last_used = 0;
+        return error;
+    }
+
+    slot->args = args;
+    av_strlcpy(slot->format_name, args.format_name, sizeof(slot->format_name));
+    slot->args.format_name = slot->format_name;
+    av_strlcpy(slot->in_format_name, args.in_format_name ? args.in_format_name : "",
+               sizeof(slot->in_format_name));
+    slot->args.in_format_name = slot->in_format_name;
+    slot->last_used = *tick;
+
+    *p_session = slot->session;
+
+    return 0;
+}
+
+// Take the next job of a batch that may still use one more worker, lock must be held.
+static Batch *take_job_locked(TranscodingJob **p_job)
+{
+    Batch *batch;
+
+    for (batch = worker_pool.batches; batch; batch = batch->next)
+    {
+        if (batch->next_job < batch->nb_jobs &&
+            (batch->max_workers <= 0 || batch->nb_running < batch->max_workers))
+        {
+            *p_job = &batch->jobs[batch->next_job];
+            batch->next_job++;
+            batch->nb_running++;
+            return batch;
+        }
+    }
+
+    return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+    CachedSession cache[SESSIONS_PER_WORKER];
+    uint64_t tick = 0;
+    TranscodingSession *session = NULL;
+    TranscodingJob *job = NULL;
+    Batch *batch;
+    int i;
+
+    memset(cache, 0, sizeof(cache));
+
+    pthread_mutex_lock(&worker_pool.lock);
+    while (!worker_pool.stopping)
+    {
+        batch = take_job_locked(&job);
+        if (NULL == batch)
+        {
+            pthread_cond_wait(&worker_pool.work_cond, &worker_pool.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&worker_pool.lock);
+
+        job->status = get_session(cache, &tick, job->args, &session);
+        if (job->status == 0)
+        {
+            job->status = transcoding_session_transcode(session, &job->dst_buf,
+                                                        &job->out_bit_rate, &job->out_duration,
+                                                        job->src_buf);
+        }
+        if (job->status == 0)
+        {
+            transcoding_session_get_stats(session, &job->stats);
+        }
+        else
+        {
+            memset(&job->stats, 0, sizeof(TranscodingStats));
+        }
+
+        pthread_mutex_lock(&worker_pool.lock);
+        batch->nb_running--;
+        batch->nb_done++;
+        if (batch->nb_done == batch->nb_jobs)
+        {
+            pthread_cond_signal(&batch->done_cond);
+        }
+        else if (batch->max_workers > 0)
+        {
+            // A worker slot of a limited batch became free.
+            pthread_cond_signal(&worker_pool.work_cond);
+        }
+    }
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    for (i = 0; i < SESSIONS_PER_WORKER; i++)
+    {
+        transcoding_session_destroy(&cache[i].session);
+    }
+
+    return arg;
+}
+
+// Start the workers if they are not running yet, lock must be held.
+static int start_workers_locked(int nb_workers)
+{
+    int i, error = 0;
+
+    if (worker_pool.nb_workers > 0)
+    {
+        return 0;
+    }
+
+    if (nb_workers <= 0)
+    {
+        nb_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nb_workers <= 0)
+        {
+            nb_workers = 1;
+        }
+    }
+
+    worker_pool.threads = (pthread_t *)av_malloc_array(nb_workers, sizeof(pthread_t));
+    if (NULL == worker_pool.threads)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    worker_pool.stopping = 0;
+    for (i = 0; i < nb_workers; i++)
+    {
+        error = pthread_create(&worker_pool.threads[i], NULL, &worker_main, NULL);
+        if (error != 0)
+        {
+            fprintf(stderr, "Could not start transcoding worker.\n");
+            break;
+        }
+    }
+
+    // Run with the workers that could be started.
+    worker_pool.nb_workers = i;
+    if (i == 0)
+    {
+        av_freep(&worker_pool.threads);
+        return AVERROR(error);
+    }
+
+    return 0;
+}
+
+int transcoding_batch_start(int nb_workers)
+{
+    int error;
+
+    error = transcoding_global_init();
+    if (error < 0)
+    {
+        return error;
+    }
+
+    pthread_mutex_lock(&worker_pool.lock);
+    error = start_workers_locked(nb_workers);
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    return error;
+}
+
+void transcoding_batch_stop(void)
+{
+    pthread_t *threads;
+    int i, nb_workers;
+
+    pthread_mutex_lock(&worker_pool.lock);
+    threads    = worker_pool.threads;
+    nb_workers = worker_pool.nb_workers;
+    worker_pool.threads    = NULL;
+    worker_pool.nb_workers = 0;
+    worker_pool.stopping   = 1;
+    pthread_cond_broadcast(&worker_pool.work_cond);
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    for (i = 0; i < nb_workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    av_free(threads);
+}
+
+int transcoding_batch(TranscodingJob *jobs, size_t nb_jobs, const TranscodingBatchOptions *opts)
+{
+    Batch batch, **pp;
+    size_t i;
+    int error;
+
+    if (nb_jobs == 0)
+    {
+        return 0;
+    }
+
+    error = transcoding_batch_start(0);
+    if (error < 0)
+    {
+        return error;
+    }
+
+    memset(&batch, 0, sizeof(Batch));
+    batch.jobs        = jobs;
+    batch.nb_jobs     = nb_jobs;
+    batch.max_workers = opts ? opts->max_workers : 0;
+    pthread_cond_init(&batch.done_cond, NULL);
+
+    for (i = 0; i < nb_jobs; i++)
+    {
+        jobs[i].dst_buf.buf  = NULL;
+        jobs[i].dst_buf.size = 0;
+        jobs[i].status       = AVERROR_EXIT;
+    }
+
+    pthread_mutex_lock(&worker_pool.lock);
+
+    // Append the batch, so that earlier batches are served first.
+    pp = &worker_pool.batches;
+    while (*pp)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = &batch;
+    pthread_cond_broadcast(&worker_pool.work_cond);
+
+    while (batch.nb_done < batch.nb_jobs)
+    {
+        pthread_cond_wait(&batch.done_cond, &worker_pool.lock);
+    }
+
+    pp = &worker_pool.batches;
+    while (*pp != &batch)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = batch.next;
+
+    pthread_mutex_unlock(&worker_pool.lock);
+
+    pthread_cond_destroy(&batch.done_cond);
+
+    for (i = 0; i < nb_jobs; i++)
+    {
+        if (jobs[i].status < 0)
+        {
+            return jobs[i].status;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE // MAP_POPULATE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavformat/avio.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+
+#include "transcoding.h"
+#include "transcoding_internal.h"
+
+
+// Bytes written to the output file at once, unless args tell otherwise
+#define FILE_BUFFER_SIZE (64 * 1024)
+
+// Output file written by the muxer, which may seek back to rewrite headers.
+typedef struct FileSink {
+    int     fd;
+    int64_t pos;
+    int64_t size;
+} FileSink;
+
+static int file_write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    FileSink *sink = (FileSink *)opaque;
+    int left = buf_size;
+
+    while (left > 0)
+    {
+        ssize_t n = write(sink->fd, buf, left);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            int error = AVERROR(errno);
+            fprintf(stderr, "Could not write output file: %s\n", av_err2str(error));
+            return error;
+        }
+        buf  += n;
+        left -= (int)n;
+    }
+
+    sink->pos += buf_size;
+    sink->size = FFMAX(sink->size, sink->pos);
+
+    return buf_size;
+}
+
+static int64_t file_seek(void *opaque, int64_t offset, int whence)
+{
+    FileSink *sink = (FileSink *)opaque;
+    off_t pos;
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return sink->size;
+    }
+
+    pos = lseek(sink->fd, offset, whence & ~AVSEEK_FORCE);
+    if (pos < 0)
+    {
+        return AVERROR(errno);
+    }
+    sink->pos = pos;
+
+    return pos;
+}
+
+// Map the whole input file, read once from start to end.
+static int map_input_file(const char *path, BufferData *src_buf)
+{
+    struct stat st;
+    void *addr;
+    int flags = MAP_PRIVATE;
+    int fd, error;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not open input file %s: %s\n", path, av_err2str(error));
+        return error;
+    }
+
+    if (fstat(fd, &st) < 0)
+    {
+        error = AVERROR(errno);
+        close(fd);
+        return error;
+    }
+    if (st.st_size == 0)
+    {
+        fprintf(stderr, "Input file %s is empty.\n", path);
+        close(fd);
+        return AVERROR_INVALIDDATA;
+    }
+
+#ifdef MAP_POPULATE
+    // Fault the pages in up front rather than one by one while demuxing.
+    flags |= MAP_POPULATE;
+#endif
+
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not map input file %s: %s\n", path, av_err2str(error));
+        close(fd);
+        return error;
+    }
+    close(fd); // the mapping keeps the file
+
+    posix_madvise(addr, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    src_buf->buf  = (uint8_t *)addr;
+    src_buf->size = (size_t)st.st_size;
+
+    return 0;
+}
+
+int transcoding_session_transcode_file(TranscodingSession *session,
+                                       const char *in_path, const char *out_path,
+                                       int *out_bit_rate, float *out_duration)
+{
+    JobIO io;
+    JobResult result;
+    FileSink sink;
+    BufferData src_buf;
+    int ret;
+
+    ret = map_input_file(in_path, &src_buf);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    sink.fd   = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    sink.pos  = 0;
+    sink.size = 0;
+    if (sink.fd < 0)
+    {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not open output file %s: %s\n", out_path, av_err2str(ret));
+        munmap(src_buf.buf, src_buf.size);
+        return ret;
+    }
+
+    memset(&io, 0, sizeof(JobIO));
+    io.src_buf           = src_buf;
+    io.write_opaque      = &sink;
+    io.write_packet      = &file_write_packet;
+    io.write_seek        = &file_seek;
+    io.write_buffer_size = transcoding_session_args(session)->out_buffer_size > 0 ?
+                           transcoding_session_args(session)->out_buffer_size : FILE_BUFFER_SIZE;
+
+    ret = transcoding_session_run(session, &io, &result);
+
+    if (close(sink.fd) < 0 && ret == 0)
+    {
+        ret = AVERROR(errno);
+    }
+    munmap(src_buf.buf, src_buf.size);
+
+    if (ret < 0)
+    {
+        // Don't leave a truncated output behind.
+        unlink(out_path);
+        return ret;
+    }
+
+    get_job_output_info((size_t)sink.size, &result, out_bit_rate, out_duration);
+
+    return 0;
+}
+
+int transcoding_file(const char *in_path, const char *out_path,
+                     int *out_bit_rate, float *out_duration, const TranscodingArgs args)
+{
+    TranscodingSession *session = NULL;
+    int ret;
+
+    ret = transcoding_session_create(&session, args);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = transcoding_session_transcode_file(session, in_path, out_path, out_bit_rate, out_duration);
+
+    transcoding_session_destroy(&session);
+
+    return ret;
+}